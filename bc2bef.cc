@@ -2,19 +2,30 @@
 #define __STDC_LIMIT_MACROS
 
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <algorithm>
 #include <map>
 #include <memory>
 #include <numeric>
+#include <set>
 #include <sstream>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Config/llvm-config.h>
+#if LLVM_VERSION_MAJOR >= 14
+#include <llvm/Bitcode/BitcodeReader.h>
+#else
 #include <llvm/Bitcode/ReaderWriter.h>
+#endif
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constant.h>
 #include <llvm/IR/Constants.h>
@@ -27,6 +38,7 @@
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 using namespace llvm;
 using namespace std;
@@ -35,11 +47,25 @@ static const int kLocalPos = 9 * 9 * 9 * 9 * 8;
 static const int kStackPos = 9 * 9 * 9 * 9 * 8;
 static const int kGlobalPos = 9 * 9 * 9 * 9 * 9 * 6;
 static const int kHeapPos = 9 * 9 * 9 * 9 * 9 * 8;
+// The heap starts with the heads of the free lists of calloc() by the
+// size of the blocks, from 0 to kNumSizeClasses - 1.
+static const int kNumSizeClasses = 16;
 
 bool is_debug;
+// Jump between blocks through the lanes of emitLanes() instead of the
+// chain of dispatchers.
+bool use_lanes;
+
+int getNumArgs(const CallInst& ci) {
+#if LLVM_VERSION_MAJOR >= 14
+  return ci.arg_size();
+#else
+  return ci.getNumArgOperands();
+#endif
+}
 
 int getConstInt(const Value* v) {
-  auto cv = dynamic_cast<const ConstantInt*>(v);
+  auto cv = dyn_cast<ConstantInt>(v);
   assert(cv);
  return cv->getLimitedValue();
 }
@@ -64,11 +90,358 @@ int getSizeOfType(const Type* t) {
     }
     return s;
   }
-  t->dump();
+  t->print(errs());
   assert(false);
 }
 
+// How bc2bef used to push |v|: a product of two digits for 10 to 81, or
+// the digits of |v| in base 9.
+string base9Int(int v) {
+  string code;
+  if (v > 9 && v < 82) {
+    for (int i = 2; i < 10; i++) {
+      for (int j = i; j < 10; j++) {
+        if (i * j == v) {
+          code += '0' + i;
+          code += '0' + j;
+          code += '*';
+          return code;
+        }
+      }
+    }
+  }
+
+  char op = '+';
+  if (v < 0) {
+    v = -v;
+    op = '-';
+  }
+  vector<int> c;
+  do {
+    c.push_back(v % 9);
+    v /= 9;
+  } while (v);
+
+  if (op == '-')
+    code += '0';
+  for (size_t i = 0; i < c.size(); i++) {
+    if (i != 0)
+      code += "9*";
+    char v = c[c.size() - i - 1];
+    if (v || c.size() == 1) {
+      code += (v + '0');
+      if (i != 0 || op == '-')
+        code += op;
+    }
+  }
+  return code;
+}
+
+// The shortest code which pushes each of 0 to kIntTableSize - 1, found
+// breadth first by length: from the digits, the code of a and of b
+// followed by '+', '-' or '*', and the code of a followed by ":+" or
+// ":*". This covers the block ids and the addresses of locals and phis.
+static const int kIntTableSize = 1 << 16;
+
+const vector<string>& intTable() {
+  static vector<string> table;
+  if (!table.empty())
+    return table;
+
+  table.resize(kIntTableSize);
+  vector<vector<int>> by_len(2);
+  for (int d = 0; d < 10; d++) {
+    table[d] = string(1, '0' + d);
+    by_len[1].push_back(d);
+  }
+  int found = 10;
+  for (size_t len = 2; found < kIntTableSize; len++) {
+    by_len.push_back(vector<int>());
+    auto add = [&](int64_t v, const string& code) {
+      if (v < 0 || v >= kIntTableSize || !table[v].empty())
+        return;
+      table[v] = code;
+      by_len[len].push_back(v);
+      found++;
+    };
+    for (int a : by_len[len - 2]) {
+      add(2 * (int64_t)a, table[a] + ":+");
+      add((int64_t)a * a, table[a] + ":*");
+    }
+    for (size_t i = 1; i + 1 < len; i++) {
+      for (int a : by_len[i]) {
+        for (int b : by_len[len - 1 - i]) {
+          add((int64_t)a + b, table[a] + table[b] + '+');
+          add((int64_t)a - b, table[a] + table[b] + '-');
+          add((int64_t)a * b, table[a] + table[b] + '*');
+        }
+      }
+    }
+  }
+  return table;
+}
+
+// The code which pushes |v|. Beyond the table, this is q * m + r or
+// q * m - r for the m up to 81 which makes it the shortest.
+string intProgram(int v) {
+  const vector<string>& table = intTable();
+  if (v >= 0 && v < kIntTableSize)
+    return table[v];
+
+  // Neither -v nor base9Int() works for INT_MIN.
+  if (v == INT_MIN)
+    return intProgram(v + 1) + "1-";
+
+  static map<int, string> cache;
+  auto found = cache.find(v);
+  if (found != cache.end())
+    return found->second;
+
+  string best = base9Int(v);
+  if (v < 0) {
+    string code = '0' + intProgram(-v) + '-';
+    if (code.size() < best.size())
+      best = code;
+  } else {
+    for (int m = 2; m < 82; m++) {
+      int q = v / m;
+      int r = v % m;
+      string code = intProgram(q) + table[m] + '*';
+      if (r)
+        code += table[r] + '+';
+      if (code.size() < best.size())
+        best = code;
+      code = intProgram(q + 1) + table[m] + '*' + table[m - r] + '-';
+      if (r && code.size() < best.size())
+        best = code;
+    }
+  }
+  cache[v] = best;
+  return best;
+}
+
+// An op of the code bc2bef generates: a push of |value| if |c| is 0, or
+// the Befunge op |c|. 'S' and 'G' stand for the cells emitCode() lays out
+// for them.
+struct Op {
+  char c;
+  int value;
+};
+
+// The cells |ops| take once their pushes are resolved.
+int opsCells(const vector<Op>& ops) {
+  int cells = 0;
+  for (const Op& op : ops)
+    cells += op.c ? 1 : intProgram(op.value).size();
+  return cells;
+}
+
+// Runs |ops| on |stack| and the cells in |mem| as befunge does. A cell
+// which isn't in |mem| holds x * 7 + y * 13. Returns false if they divide
+// by zero or overflow.
+bool runOps(const vector<Op>& ops, vector<int>* stack,
+            map<pair<int, int>, int>* mem) {
+  auto pop = [stack]() {
+    assert(!stack->empty());
+    int v = stack->back();
+    stack->pop_back();
+    return v;
+  };
+  for (const Op& op : ops) {
+    switch (op.c) {
+    case 0:
+      stack->push_back(op.value);
+      break;
+    case ' ':
+      break;
+    case '+': case '-': case '*': case '/': case '%': case '`': {
+      int64_t b = pop();
+      int64_t a = pop();
+      if ((op.c == '/' || op.c == '%') && b == 0)
+        return false;
+      int64_t r = (op.c == '+' ? a + b : op.c == '-' ? a - b :
+                   op.c == '*' ? a * b : op.c == '/' ? a / b :
+                   op.c == '%' ? a % b : a > b);
+      if (r < INT_MIN || r > INT_MAX)
+        return false;
+      stack->push_back(r);
+      break;
+    }
+    case '!':
+      stack->push_back(!pop());
+      break;
+    case ':': {
+      int v = pop();
+      stack->push_back(v);
+      stack->push_back(v);
+      break;
+    }
+    case '\\': {
+      int b = pop();
+      int a = pop();
+      stack->push_back(b);
+      stack->push_back(a);
+      break;
+    }
+    case '$':
+      pop();
+      break;
+    case 'g': {
+      int y = pop();
+      int x = pop();
+      auto found = mem->find(make_pair(x, y));
+      stack->push_back(found != mem->end() ? found->second : x * 7 + y * 13);
+      break;
+    }
+    case 'p': {
+      int y = pop();
+      int x = pop();
+      (*mem)[make_pair(x, y)] = pop();
+      break;
+    }
+    default:
+      assert(false);
+    }
+  }
+  return true;
+}
+
+// A rewrite of peephole(). In |from| and |to|, a digit is a push of it,
+// 'a' and 'b' are pushes of any values, the same on both sides, and
+// {...} in |to| is a push of what the ops in it leave. Other characters
+// are ops. Both sides take |in| values and leave |out| values on the
+// stack, the same ones, and store the same cells, as
+// checkPeepholeRules() verifies.
+struct PeepholeRule {
+  const char* from;
+  const char* to;
+  int in;
+  int out;
+};
+
+const PeepholeRule kPeepholeRules[] = {
+  // Operations on constants, such as branch targets relative to a block.
+  { "ab+", "{ab+}", 0, 1 },
+  { "ab-", "{ab-}", 0, 1 },
+  { "ab*", "{ab*}", 0, 1 },
+  { "ab/", "{ab/}", 0, 1 },
+  { "ab%", "{ab%}", 0, 1 },
+  { "ab`", "{ab`}", 0, 1 },
+  { "a!", "{a!}", 0, 1 },
+  { "a+b+", "{ab+}+", 1, 1 },
+  { "a-b-", "{ab+}-", 1, 1 },
+  { "a+b-", "{ab-}+", 1, 1 },
+  { "a-b+", "{ab-}-", 1, 1 },
+  { "a*b*", "{ab*}*", 1, 1 },
+  // make2D() of a constant address.
+  { "a:9%\\9/", "{a9%}{a9/}", 0, 2 },
+  { "a:9%9+\\9/", "{a9%9+}{a9/}", 0, 2 },
+  { "a:9%9+9+\\9/", "{a9%9+9+}{a9/}", 0, 2 },
+  // Ops which change nothing.
+  { "0+", "", 1, 1 },
+  { "0-", "", 1, 1 },
+  { "1*", "", 1, 1 },
+  { "1/", "", 1, 1 },
+  { "!!!", "!", 1, 1 },
+  { "a$", "", 0, 0 },
+  { ":$", "", 1, 1 },
+  { "a\\$", "$a", 1, 1 },
+  { "ab\\", "ba", 0, 2 },
+  // A load of the cell just stored, such as the local pointer after a
+  // call, a local, or memory through a pointer in a register. Locals and
+  // memory are never in the rows of the registers.
+  { "abpabg", ":abp", 1, 1 },
+  { "20ga+:9%\\9/p20ga+:9%\\9/g", ":20ga+:9%\\9/p", 1, 1 },
+  { "abg:9%9+\\9/pabg:9%9+\\9/g", ":abg:9%9+\\9/p", 1, 1 },
+};
+
+// The ops of |code| in a rule, with |cap| for 'a' and 'b'. Returns false
+// if a {...} can't be computed.
+bool ruleOps(const char* code, const int* cap, vector<Op>* ops) {
+  for (const char* p = code; *p; p++) {
+    if (isdigit(*p)) {
+      ops->push_back(Op{0, *p - '0'});
+    } else if (*p == 'a' || *p == 'b') {
+      ops->push_back(Op{0, cap[*p - 'a']});
+    } else if (*p == '{') {
+      const char* end = strchr(p, '}');
+      vector<Op> expr;
+      ruleOps(string(p + 1, end).c_str(), cap, &expr);
+      vector<int> stack;
+      map<pair<int, int>, int> mem;
+      if (!runOps(expr, &stack, &mem))
+        return false;
+      assert(stack.size() == 1);
+      ops->push_back(Op{0, stack[0]});
+      p = end;
+    } else {
+      ops->push_back(Op{*p, 0});
+    }
+  }
+  return true;
+}
+
+// Whether |from| matches |ops| from |i| on, skipping spaces. Sets |end|
+// past the match and |cap| to the values of 'a' and 'b'.
+bool matchRule(const vector<Op>& ops, size_t i, const char* from,
+               size_t* end, int* cap) {
+  bool captured[2] = { false, false };
+  for (const char* p = from; *p; p++) {
+    while (i < ops.size() && ops[i].c == ' ')
+      i++;
+    if (i == ops.size())
+      return false;
+    const Op& op = ops[i++];
+    if (isdigit(*p)) {
+      if (op.c || op.value != *p - '0')
+        return false;
+    } else if (*p == 'a' || *p == 'b') {
+      int k = *p - 'a';
+      if (op.c || (captured[k] && cap[k] != op.value))
+        return false;
+      captured[k] = true;
+      cap[k] = op.value;
+    } else if (op.c != *p) {
+      return false;
+    }
+  }
+  *end = i;
+  return true;
+}
+
+// Runs both sides of each rule on random values, stacks and cells.
+void checkPeepholeRules() {
+  uint32_t seed = 1;
+  auto rand = [&seed]() {
+    seed = seed * 1103515245 + 12345;
+    return (int)(seed >> 16) % 20000 - 9999;
+  };
+  for (const PeepholeRule& rule : kPeepholeRules) {
+    int checked = 0;
+    for (int t = 0; t < 100; t++) {
+      int cap[2] = { rand(), t < 50 ? t % 10 : rand() };
+      vector<int> stack;
+      for (int i = 0; i < rule.in; i++)
+        stack.push_back(rand());
+      vector<int> stack2 = stack;
+      map<pair<int, int>, int> mem, mem2;
+      vector<Op> from, to;
+      ruleOps(rule.from, cap, &from);
+      if (!runOps(from, &stack, &mem) || !ruleOps(rule.to, cap, &to))
+        continue;
+      bool ok = runOps(to, &stack2, &mem2);
+      assert(ok && stack == stack2 && mem == mem2);
+      assert(stack.size() == (size_t)rule.out);
+      checked++;
+    }
+    assert(checked);
+  }
+}
+
 class B2B {
+  // Surrounds the value of each genInt() in |code_|.
+  static const char kIntMark = '\x01';
+
   enum MemType {
     LOCAL,
     MEM,
@@ -76,7 +449,12 @@ class B2B {
   };
 
 public:
-  explicit B2B(Module* module) : module_(module) {
+  explicit B2B(Module* module)
+    : module_(module), pending_(NULL), pending_at_(0),
+      one_get_end_(string::npos), first_free_reg_(-3), num_ints_(0),
+      int_cells_(0), base9_cells_(0), num_hoisted_(0), num_rewrites_(0),
+      rewrite_cells_(0), num_inlined_(0), num_tail_calls_(0),
+      uses_free_(false), freed_sizes_(kNumSizeClasses) {
   }
 
   void filterInstructions() {
@@ -89,8 +467,9 @@ public:
               const Function* func =
                   static_cast<const CallInst&>(inst).getCalledFunction();
               assert(func);
-              if (func->getName() != "llvm.lifetime.start" &&
-                  func->getName() != "llvm.lifetime.end") {
+              // LLVM 14 suffixes them with the type of the pointer.
+              if (!func->getName().startswith("llvm.lifetime.start") &&
+                  !func->getName().startswith("llvm.lifetime.end")) {
                 break;
               }
             } // fall through
@@ -103,18 +482,85 @@ public:
         }
 
         for (Instruction* inst : removes) {
-          inst->dump();
+          errs() << *inst << "\n";
           inst->removeFromParent();
         }
       }
     }
   }
 
+  // Inlines the calls of small functions which don't call themselves,
+  // such as the helpers of lisp.c which build and test atoms, and drops
+  // the functions which are no longer called.
+  void inlineCalls() {
+    vector<CallInst*> calls;
+    for (Function& func : module_->getFunctionList()) {
+      for (BasicBlock& block : func.getBasicBlockList()) {
+        for (Instruction& inst : block.getInstList()) {
+          auto ci = dyn_cast<CallInst>(&inst);
+          if (!ci)
+            continue;
+          Function* callee = ci->getCalledFunction();
+          if (callee && callee != &func && isInlinable(*callee))
+            calls.push_back(ci);
+        }
+      }
+    }
+
+    for (CallInst* ci : calls) {
+      InlineFunctionInfo info;
+#if LLVM_VERSION_MAJOR >= 14
+      if (InlineFunction(*ci, info, nullptr, false).isSuccess())
+        num_inlined_++;
+#else
+      if (InlineFunction(ci, info, false))
+        num_inlined_++;
+#endif
+    }
+
+    vector<Function*> unused;
+    for (Function& func : module_->getFunctionList()) {
+      if (!func.isDeclaration() && func.use_empty() &&
+          func.getName() != "main") {
+        unused.push_back(&func);
+      }
+    }
+    for (Function* func : unused)
+      func->eraseFromParent();
+  }
+
+  bool isInlinable(const Function& func) {
+    static const size_t kMaxInlineSize = 16;
+    if (func.isDeclaration() || func.getName() == "main")
+      return false;
+    size_t size = 0;
+    for (const BasicBlock& block : func.getBasicBlockList()) {
+      size += block.size();
+      for (const Instruction& inst : block.getInstList()) {
+        auto ci = dyn_cast<CallInst>(&inst);
+        if (ci && ci->getCalledFunction() == &func)
+          return false;
+      }
+    }
+    return size <= kMaxInlineSize;
+  }
+
   void run() {
+    checkPeepholeRules();
     filterInstructions();
+    inlineCalls();
     int entry_point = assignIds();
     emitSetup(entry_point);
     translate();
+    if (use_lanes)
+      emitLanes();
+    fprintf(stderr, "constants: %d in %d cells, %d fewer than base 9, "
+            "%d hoisted into registers\n",
+            num_ints_, int_cells_, base9_cells_ - int_cells_, num_hoisted_);
+    fprintf(stderr, "peephole: %d rewrites, %d cells fewer\n",
+            num_rewrites_, rewrite_cells_);
+    fprintf(stderr, "calls: %d inlined, %d tail calls\n",
+            num_inlined_, num_tail_calls_);
   }
 
   const string& code() const { return code_; }
@@ -142,6 +588,8 @@ private:
             const Function* func =
                 static_cast<const CallInst&>(inst).getCalledFunction();
             assert(func);
+            if (func->getName() == "free")
+              noteFree(static_cast<const CallInst&>(inst).getArgOperand(0));
             if (func->getName() != "putchar" &&
                 func->getName() != "getchar" &&
                 func->getName() != "calloc" &&
@@ -158,6 +606,7 @@ private:
     }
 
     map<const Value*, int> ref_map;
+    map<const Value*, int> num_uses;
     for (const Function& func : module_->getFunctionList()) {
       if (func.isDeclaration())
         continue;
@@ -166,18 +615,24 @@ private:
       for (const BasicBlock& block : func.getBasicBlockList()) {
         for (const Instruction& inst : block.getInstList()) {
           for (size_t i = 0; i < inst.getNumOperands(); i++) {
-            auto* o = dynamic_cast<const Instruction*>(inst.getOperand(i));
+            auto* o = dyn_cast<Instruction>(inst.getOperand(i));
             if (!o)
               continue;
+            // A phi takes its value at the branch from the block it comes
+            // from, which may be past a call after the value.
+            const Instruction* user = &inst;
+            if (auto phi = dyn_cast<PHINode>(&inst))
+              user = phi->getIncomingBlock(i)->getTerminator();
             int rel = 1;
-            if (block_map_[&inst] != block_map_[o])
+            if (block_map_[user] != block_map_[o])
               rel = 3;
             else if (o->getNextNode() != &inst)
               rel = 2;
             else
               rel = 1;
-            o->dump();
+            errs() << *o << "\n";
             ref_map[o] = max(ref_map[o], rel);
+            num_uses[o]++;
           }
         }
       }
@@ -185,12 +640,17 @@ private:
       local_size_map_[&func] = id;
     }
 
+    for (auto& r : ref_map) {
+      if (r.second == 1 && num_uses[r.first] == 1)
+        stack_values_.insert(r.first);
+    }
+
     for (const Function& func : module_->getFunctionList()) {
       if (func.isDeclaration())
         continue;
 
       int id = 0;
-      for (const Argument& arg : func.getArgumentList()) {
+      for (const Argument& arg : func.args()) {
         id_map_.insert(make_pair(&arg, id));
         id++;
       }
@@ -206,7 +666,10 @@ private:
             id_map_.insert(make_pair(&inst, -2));
           } else
           */
-          if (rel != 3) {
+          // The branch to a block sets its phis through cells by their
+          // ids, and a conditional branch sets those of both targets,
+          // whose registers may be the same, so phis go to memory.
+          if (rel != 3 && inst.getOpcode() != Instruction::PHI) {
             id_map_.insert(make_pair(&inst, reg_id));
             reg_id--;
           } else {
@@ -214,6 +677,7 @@ private:
             id++;
           }
         }
+        first_free_reg_ = min(first_free_reg_, reg_id);
       }
 
       local_size_map_[&func] = id;
@@ -227,13 +691,23 @@ private:
       if (func.isDeclaration())
         continue;
 
+      // The allocas are all in the entry block, so the frame has the same
+      // size wherever the function returns or jumps to a tail callee.
       stack_size_ = 0;
+      for (const BasicBlock& block : func) {
+        for (const Instruction& inst : block) {
+          if (auto alloca = dyn_cast<AllocaInst>(&inst)) {
+            assert(&block == &func.getEntryBlock());
+            stack_size_ += getSizeOfType(alloca->getAllocatedType());
+          }
+        }
+      }
 
       char buf[999];
       sprintf(buf, "*** %s *** %d", func.getName().data(), func_map_[&func]);
       bef_.push_back(indent + buf);
 
-      for (const Argument& arg : func.getArgumentList())
+      for (const Argument& arg : func.args())
         set(LOCAL, id_map_[&arg]);
 
       const Instruction* last_inst = NULL;
@@ -254,11 +728,12 @@ private:
                   inst.getOpcode(), inst.getOpcodeName(), inst.hasMetadata());
           last_inst = &inst;
           handleInstrcution(inst);
+          flushPending();
           if (inst.getOpcode() != Instruction::Br &&
               inst.getOpcode() != Instruction::Switch &&
               inst.getOpcode() != Instruction::Store &&
               inst.getOpcode() != Instruction::Ret) {
-            set(LOCAL, getInstId(inst));
+            deferSet(inst);
           }
           code_ += ' ';
         }
@@ -278,7 +753,7 @@ private:
   void emitSetup(int entry_point) {
     genInt(kStackPos);
     setStackPointer();
-    genInt(kHeapPos);
+    genInt(kHeapPos + kNumSizeClasses);
     setHeapPointer();
     genInt(kLocalPos);
     setLocalPointer();
@@ -301,7 +776,7 @@ private:
         continue;
       }
 
-      if (!dynamic_cast<const ConstantPointerNull*>(gv.getInitializer())) {
+      if (!isa<ConstantPointerNull>(gv.getInitializer())) {
         int v = getConstInt(gv.getInitializer());
         if (v) {
           genInt(v);
@@ -317,7 +792,22 @@ private:
   }
 
   void emitBlock(const Value& block) {
+    flushPending();
     int block_id = block_map_.at(&block);
+    if (use_lanes) {
+      assert(block_id == (int)lane_rows_.size());
+      lane_rows_.push_back(bef_.size());
+      bef_.push_back(">:#v_ >$");
+      bef_.push_back("   <");
+      bef_.push_back("");
+      bef_.push_back("^        <");
+
+      genInt(block_id);
+      code_ += "-";
+      emitCode(lane_rows_.back(), true);
+      return;
+    }
+
     bef_.push_back(">:#v_ >$");
     bef_.push_back("v-1<>  1+^");
     bef_.push_back("v   ^_^#:<");
@@ -328,7 +818,91 @@ private:
     emitCode(y, true);
   }
 
+  // With -l, every block starts with four rows, and the ones of each
+  // block whose id is a multiple of 2^k reach out to the lanes of level
+  // k, which are columns to the right of everything else:
+  //
+  //   >:#v_ >$  <code>   ... >                >   row 0
+  //      <                   $_v#<test k>         row 1
+  //                         v-N_+N        ^       row 2
+  //   ^        <                          >       row 3
+  //
+  // Going down the 'v' of level k from block i, the IP skips the rows
+  // which don't reach the column and comes to the '>' of block i + 2^k,
+  // as going up the '^' does to block i - 2^k. The id on the stack is
+  // relative to the block. Where it isn't 0, the IP wraps around row 1
+  // and tries the highest level first, and takes the first one whose
+  // 2^k is at most the distance left, so a jump takes O(log N) of these
+  // hops instead of a step per block in between.
+  void emitLanes() {
+    int n = lane_rows_.size();
+    int top = 0;
+    while ((2 << top) < n)
+      top++;
+
+    int x = 80;
+    for (const string& row : bef_)
+      x = max<int>(x, row.size() + 1);
+    vector<int> starts;
+    for (int k = 0; k <= top; k++) {
+      starts.push_back(x);
+      x += laneWidth(k);
+    }
+
+    for (int i = 0; i < n; i++) {
+      int level = 0;
+      while (level < top && (i == 0 || !(i >> level & 1)))
+        level++;
+      for (int k = 0; k <= level; k++)
+        emitLane(lane_rows_[i], k, starts[k]);
+    }
+  }
+
+  // The cells of level |k| from column |x| in the rows from |y|, as in the
+  // comment of emitLanes(). The IP comes to row 1 going west with the
+  // distance |d| on the stack, and goes on west if |d| / 2^k is 0. Level 0
+  // takes any distance. Otherwise it pushes d > 0 and comes down to the
+  // '_' of row 2, which subtracts 2^k and goes down for a positive |d|,
+  // or adds 2^k and goes up for a negative one.
+  void emitLane(int y, int k, int x) {
+    string num = intProgram(1 << k);
+    string test = k ? "::0`\\" + num + "/!" : ":0`";
+    int p = x + 1 + num.size();
+
+    emitChar(x, y, '>');
+
+    if (k) {
+      emitChar(p - 1, y + 1, '$');
+      emitChar(p, y + 1, '_');
+      emitChar(p + 2, y + 1, '#');
+    }
+    emitChar(p + 1, y + 1, 'v');
+    int east = p + 1 + (k ? 1 : 0);
+    for (size_t i = 0; i < test.size(); i++)
+      emitChar(east + test.size() - i, y + 1, test[i]);
+    int up = east + test.size() + 1;
+
+    emitChar(x, y + 2, 'v');
+    emitChar(x + 1, y + 2, '-');
+    for (size_t i = 0; i < num.size(); i++) {
+      emitChar(p - i, y + 2, num[i]);
+      emitChar(p + 2 + i, y + 2, num[i]);
+    }
+    emitChar(p + 1, y + 2, '_');
+    emitChar(p + 2 + num.size(), y + 2, '+');
+    emitChar(up, y + 2, '^');
+
+    emitChar(up, y + 3, '>');
+  }
+
+  int laneWidth(int k) {
+    string num = intProgram(1 << k);
+    return k ? num.size() * 2 + 12 : 8;
+  }
+
   void emitCode(int oy, bool is_block) {
+    peephole();
+    resolveConstants(is_block);
     int x = 10;
     int y = oy;
     int dx = 1;
@@ -398,6 +972,14 @@ private:
         x = 75;
       }
       emitChar(x, y, 'v');
+      if (use_lanes) {
+        y = max(y + 1, oy + 3);
+        emitChar(x, y, '<');
+        if (oy + 4 != (int)bef_.size())
+          emitChar(9, bef_.size() - 1, '^');
+        code_.clear();
+        return;
+      }
       y = max(y + 1, oy + 2);
       emitChar(x, y, '_');
       emitChar(x + 1, y, '1');
@@ -437,6 +1019,8 @@ private:
       case Instruction::Mul:
       case Instruction::SDiv:
       case Instruction::SRem:
+      case Instruction::UDiv:
+      case Instruction::URem:
       case Instruction::And:
       case Instruction::Or:
       case Instruction::Xor:
@@ -447,6 +1031,9 @@ private:
       case Instruction::PtrToInt:
       case Instruction::SExt:
       case Instruction::ZExt:
+#if LLVM_VERSION_MAJOR >= 14
+      case Instruction::Freeze:
+#endif
         getLocal(inst.getOperand(0));
         break;
 
@@ -512,6 +1099,7 @@ private:
     switch (inst.getOpcode()) {
       case Instruction::Xor:
         assert(inst.getType()->getPrimitiveSizeInBits() == 1);
+        // fall through
       case Instruction::Or:
       case Instruction::Add:
         code_ += '+'; break;
@@ -519,11 +1107,16 @@ private:
         code_ += '-'; break;
       case Instruction::And:
         assert(inst.getType()->getPrimitiveSizeInBits() == 1);
+        // fall through
       case Instruction::Mul:
         code_ += '*'; break;
+      // clang -O turns a division of values it knows aren't negative
+      // into an unsigned one, which is the same for them.
       case Instruction::SDiv:
+      case Instruction::UDiv:
         code_ += '/'; break;
       case Instruction::SRem:
+      case Instruction::URem:
         code_ += '%'; break;
       default:
         assert(false);
@@ -535,14 +1128,9 @@ private:
   }
 
   void handleRet(const Instruction& inst) {
-    if (stack_size_) {
-      getStackPointer();
-      genInt(stack_size_);
-      code_ += '-';
-      setStackPointer();
-    }
+    releaseStack();
 
-    auto func = dynamic_cast<const Function*>(inst.getParent()->getParent());
+    auto func = dyn_cast<Function>(inst.getParent()->getParent());
     assert(func);
     if (func->getName() == "main") {
       code_ += '@';
@@ -564,30 +1152,33 @@ private:
 
     fprintf(stderr, "func: %s\n", func->getName().data());
     if (func->getName() == "putchar") {
-      assert(ci.getNumArgOperands() == 1);
+      assert(getNumArgs(ci) == 1);
       getLocal(ci.getArgOperand(0));
       code_ += ",0";
     } else if (func->getName() == "getchar") {
-      assert(ci.getNumArgOperands() == 0);
+      assert(getNumArgs(ci) == 0);
       code_ += "G";
     } else if (func->getName() == "calloc") {
-      assert(ci.getNumArgOperands() == 2);
+      assert(getNumArgs(ci) == 2);
       assert(getConstInt(ci.getArgOperand(1)) == 4);
-      getHeapPointer();
-      code_ += ':';
-      getLocal(ci.getArgOperand(0));
-      code_ += "+";
-      setHeapPointer();
+      auto size = dyn_cast<ConstantInt>(ci.getArgOperand(0));
+      int n = size ? size->getLimitedValue() : 0;
+      if (n > 0 && n < kNumSizeClasses && freed_sizes_[n])
+        allocFromFreeList(n);
+      else
+        allocFresh(ci.getArgOperand(0));
     } else if (func->getName() == "free") {
+      assert(getNumArgs(ci) == 1);
+      freeBlock(ci.getArgOperand(0));
       code_ += "0";
     } else if (func->getName() == "puts") {
-      assert(ci.getNumArgOperands() == 1);
-      ci.getArgOperand(0)->dump();
-      auto ce = dynamic_cast<ConstantExpr*>(ci.getArgOperand(0));
+      assert(getNumArgs(ci) == 1);
+      errs() << *ci.getArgOperand(0) << "\n";
+      auto ce = dyn_cast<ConstantExpr>(ci.getArgOperand(0));
       assert(ce);
-      auto ge = dynamic_cast<GetElementPtrInst*>(ce->getAsInstruction());
+      auto ge = dyn_cast<GetElementPtrInst>(ce->getAsInstruction());
       assert(ge);
-      auto gv = dynamic_cast<GlobalVariable*>(ge->getOperand(0));
+      auto gv = dyn_cast<GlobalVariable>(ge->getOperand(0));
       assert(gv);
       for (size_t i = 0; gv->getInitializer()->getAggregateElement(i); i++) {
         int v = getConstInt(gv->getInitializer()->getAggregateElement(i));
@@ -600,15 +1191,28 @@ private:
     } else if (func->getName() == "exit") {
       code_ += "@";
     } else {
+      const auto& blocks = func->getBasicBlockList();
+      assert(!blocks.empty());
+      if (isTailPosition(ci)) {
+        // The callee takes over the frame and the return block id of this
+        // function, so it returns straight to our caller. The rest of the
+        // block is never run.
+        for (int i = getNumArgs(ci) - 1; i >= 0; i--)
+          getLocal(ci.getArgOperand(i));
+        releaseStack();
+        prepareBranch(NULL, &*blocks.begin());
+        emitBlock(ci);
+        num_tail_calls_++;
+        return;
+      }
+
       auto found = block_map_.find(&ci);
       assert(found != block_map_.end());
       int ret = found->second + 1;
       genInt(ret);
-      for (int i = ci.getNumArgOperands() - 1; i >= 0; i--)
+      for (int i = getNumArgs(ci) - 1; i >= 0; i--)
         getLocal(ci.getArgOperand(i));
 
-      const auto& blocks = func->getBasicBlockList();
-      assert(!blocks.empty());
       prepareBranch(NULL, &*blocks.begin());
 
       modifyLocalPointer(ci, '+');
@@ -617,9 +1221,159 @@ private:
     }
   }
 
+  // Whether the caller returns what |ci| does, or nothing, right after
+  // it. The frame of a function only holds its values, so the callee may
+  // reuse it. The allocas of the caller are released before the call,
+  // which is only safe if it has none or LLVM marked the call tail, which
+  // means the callee doesn't use them. Keeping them instead would grow
+  // the stack with each call of a tail recursive loop.
+  bool isTailPosition(const CallInst& ci) {
+    auto caller = ci.getParent()->getParent();
+    if (caller->getName() == "main")
+      return false;
+    if (stack_size_ && !ci.isTailCall())
+      return false;
+    auto ret = dyn_cast_or_null<ReturnInst>(ci.getNextNode());
+    return ret && (!ret->getNumOperands() || ret->getOperand(0) == &ci);
+  }
+
+  // Pops the allocas of the function from the stack.
+  void releaseStack() {
+    if (stack_size_) {
+      getStackPointer();
+      genInt(stack_size_);
+      code_ += '-';
+      setStackPointer();
+    }
+  }
+
+  // Each block of calloc() has its size in the cell before it, and free()
+  // puts it on the list of blocks of that size, linked through their
+  // first cells. This takes the first block of the list for |n| cells,
+  // or a new one after the heap pointer if the list is empty, without
+  // branching: with the head h of the list, the block is
+  // h + !h * (HP + 1). Only a block from the list needs zeroing, but
+  // without a branch a new one is zeroed as well, so this is only used for
+  // the sizes noteFree() found.
+  void allocFromFreeList(int n) {
+    genInt(kHeapPos + n);
+    make2D(MEM);
+    code_ += "g:";
+    setTemp(0);
+    code_ += "!:";
+    getHeapPointer();
+    code_ += "1+*";
+    getTemp(0);
+    code_ += "+\\";
+    genInt(n + 1);
+    code_ += '*';
+    getHeapPointer();
+    code_ += '+';
+    setHeapPointer();
+
+    // The list goes on from the first cell of the block, which is the
+    // next block of h, or 0 for a new block.
+    code_ += ':';
+    make2D(MEM);
+    code_ += 'g';
+    genInt(kHeapPos + n);
+    make2D(MEM);
+    code_ += 'p';
+
+    code_ += ':';
+    genInt(n);
+    code_ += "\\1-";
+    make2D(MEM);
+    code_ += 'p';
+    for (int i = 0; i < n; i++) {
+      code_ += ":0\\";
+      genInt(i);
+      code_ += '+';
+      make2D(MEM);
+      code_ += 'p';
+    }
+  }
+
+  // A block of |size| cells after the heap pointer, which no one has
+  // written yet, so they are 0. Only free() reads the size cell before
+  // the block, so a program which never calls it goes without.
+  void allocFresh(const Value* size) {
+    if (!uses_free_) {
+      getHeapPointer();
+      code_ += ':';
+      getLocal(size);
+      code_ += '+';
+      setHeapPointer();
+      return;
+    }
+
+    getLocal(size);
+    code_ += ':';
+    setTemp(0);
+    getHeapPointer();
+    make2D(MEM);
+    code_ += 'p';
+    getHeapPointer();
+    code_ += "1+:";
+    getTemp(0);
+    code_ += '+';
+    setHeapPointer();
+  }
+
+  // Marks the size of block free(ptr) takes as one calloc() should look
+  // for in the free lists. free() goes by the size cell of the block, so
+  // this only decides which lists are worth looking at: when the type of
+  // |ptr| doesn't tell its size, all of them.
+  void noteFree(const Value* ptr) {
+    uses_free_ = true;
+    const Type* t =
+        ptr->stripPointerCasts()->getType()->getPointerElementType();
+    if (t->isStructTy() || t->isArrayTy()) {
+      int n = getSizeOfType(t);
+      if (n < kNumSizeClasses)
+        freed_sizes_[n] = true;
+    } else {
+      freed_sizes_.assign(kNumSizeClasses, true);
+    }
+  }
+
+  // Puts the block at |ptr| on the free list of its size. Larger blocks
+  // go to the list of size 0, which calloc() never takes from. NULL goes
+  // there too, and the link it would store at address 0 goes to the cell
+  // of temp 2, which is address -4, instead.
+  void freeBlock(const Value* ptr) {
+    getLocal(ptr);
+    code_ += ':';
+    setTemp(1);
+    code_ += "1-";
+    make2D(MEM);
+    code_ += "g:";
+    genInt(kNumSizeClasses - 1);
+    code_ += "`!*";
+    getTemp(1);
+    code_ += "!!*:";
+    setTemp(0);
+
+    genInt(kHeapPos);
+    code_ += '+';
+    make2D(MEM);
+    code_ += 'g';
+    getTemp(1);
+    code_ += ":!4*-";
+    make2D(MEM);
+    code_ += 'p';
+
+    getTemp(1);
+    getTemp(0);
+    genInt(kHeapPos);
+    code_ += '+';
+    make2D(MEM);
+    code_ += 'p';
+  }
+
   void modifyLocalPointer(const CallInst& ci, char op) {
     getLocalPointer();
-    auto func = dynamic_cast<const Function*>(ci.getParent()->getParent());
+    auto func = dyn_cast<Function>(ci.getParent()->getParent());
     assert(func);
     genInt(local_size_map_[func]);
     code_ += op;
@@ -639,7 +1393,7 @@ private:
       for (size_t i = 0; i < phi.getNumIncomingValues(); i++) {
         if (src_block != phi.getIncomingBlock(i))
           continue;
-        if (dynamic_cast<UndefValue*>(phi.getIncomingValue(i)))
+        if (isa<UndefValue>(phi.getIncomingValue(i)))
           genInt(0);
         else
           getLocal(phi.getIncomingValue(i));
@@ -675,9 +1429,7 @@ private:
     assert(si.getNumOperands() > 2);
     prepareBranch(&si, static_cast<const BasicBlock*>(si.getOperand(1)));
 
-    for (SwitchInst::ConstCaseIt it = si.case_begin();
-         it != si.case_end();
-         ++it) {
+    for (auto it : si.cases()) {
       prepareBranch(&si, it.getCaseSuccessor());
       genInt(getConstInt(it.getCaseValue()));
       getLocal(si.getOperand(0));
@@ -752,11 +1504,9 @@ private:
 
   void handleAlloca(const AllocaInst& alloca) {
     getStackPointer();
-    alloca.getAllocatedType()->dump();
+    alloca.getAllocatedType()->print(errs());
     code_ += ':';
-    int size = getSizeOfType(alloca.getAllocatedType());
-    stack_size_ += size;
-    genInt(size);
+    genInt(getSizeOfType(alloca.getAllocatedType()));
     code_ += '+';
     setStackPointer();
   }
@@ -773,53 +1523,189 @@ private:
     // TODO: check type
   }
 
+  // Pushes |v|. The code is only chosen by emitCode(), so this leaves a
+  // mark of |v| between two kIntMark in |code_|.
   void genInt(int v) {
-    if (v > 9 && v < 82) {
-      for (int i = 2; i < 10; i++) {
-        for (int j = i; j < 10; j++) {
-          if (i * j == v) {
-            code_ += '0' + i;
-            code_ += '0' + j;
-            code_ += '*';
-            return;
-          }
-        }
+    code_ += kIntMark;
+    code_ += to_string(v);
+    code_ += kIntMark;
+  }
+
+  // Rewrites the ops in |code_| with kPeepholeRules as long as one of them
+  // applies and doesn't take more cells.
+  void peephole() {
+    vector<Op> ops;
+    for (size_t i = 0; i < code_.size(); i++) {
+      if (code_[i] == kIntMark) {
+        ops.push_back(Op{0, atoi(code_.c_str() + i + 1)});
+        i = code_.find(kIntMark, i + 1);
+      } else if (isdigit(code_[i])) {
+        ops.push_back(Op{0, code_[i] - '0'});
+      } else {
+        ops.push_back(Op{code_[i], 0});
       }
     }
 
-    char op = '+';
-    if (v < 0) {
-      v = -v;
-      op = '-';
-    }
-    vector<int> c;
-    do {
-      c.push_back(v % 9);
-      v /= 9;
-    } while (v);
-
-    if (op == '-')
-      code_ += '0';
-    for (size_t i = 0; i < c.size(); i++) {
-      if (i != 0)
-        code_ += "9*";
-      char v = c[c.size() - i - 1];
-      if (v || c.size() == 1) {
-        code_ += (v + '0');
-        if (i != 0 || op == '-')
-          code_ += op;
+    for (size_t i = 0; i < ops.size(); i++) {
+      if (ops[i].c == ' ')
+        continue;
+      for (const PeepholeRule& rule : kPeepholeRules) {
+        size_t end;
+        int cap[2];
+        vector<Op> to;
+        if (!matchRule(ops, i, rule.from, &end, cap) ||
+            !ruleOps(rule.to, cap, &to)) {
+          continue;
+        }
+        vector<Op> from(ops.begin() + i, ops.begin() + end);
+        int saved = opsCells(from) - opsCells(to);
+        if (saved < 0)
+          continue;
+        ops.erase(ops.begin() + i, ops.begin() + end);
+        ops.insert(ops.begin() + i, to.begin(), to.end());
+        num_rewrites_++;
+        rewrite_cells_ += saved;
+        // The rewrite may complete a match which starts earlier.
+        i = -1;
+        break;
       }
     }
+
+    code_.clear();
+    for (const Op& op : ops) {
+      if (op.c)
+        code_ += op.c;
+      else if (op.value >= 0 && op.value < 10)
+        code_ += '0' + op.value;
+      else
+        genInt(op.value);
+    }
+  }
+
+  // Replaces the marks of genInt() in |code_| with the code of their
+  // values. With |hoist|, a constant which is used often enough that
+  // storing it into a free register first and loading it from there takes
+  // fewer cells is stored at the beginning of the code.
+  void resolveConstants(bool hoist) {
+    map<int, int> uses;
+    for (size_t i = 0; (i = code_.find(kIntMark, i)) != string::npos;
+         i = code_.find(kIntMark, i + 1) + 1) {
+      uses[atoi(code_.c_str() + i + 1)]++;
+    }
+
+    map<int, string> codes;
+    vector<pair<int, int>> candidates;
+    for (auto& u : uses) {
+      const string& code = codes[u.first] = intProgram(u.first);
+      num_ints_ += u.second;
+      int_cells_ += code.size() * u.second;
+      base9_cells_ += base9Int(u.first).size() * u.second;
+      candidates.push_back(make_pair(-(int)code.size() * u.second, u.first));
+    }
+
+    string prelude;
+    std::sort(candidates.begin(), candidates.end());
+    int reg = first_free_reg_;
+    for (auto& c : candidates) {
+      if (!hoist || !isRegister(reg))
+        break;
+      int n = uses[c.second];
+      string& code = codes[c.second];
+      string load = regCode(reg, 'g');
+      string store = code + regCode(reg, 'p');
+      int saved = (int)(code.size() * n - load.size() * n - store.size());
+      if (saved <= 0)
+        continue;
+      prelude += store;
+      code = load;
+      reg--;
+      num_hoisted_++;
+      int_cells_ -= saved;
+    }
+
+    string resolved = prelude;
+    size_t prev = 0;
+    for (size_t i; (i = code_.find(kIntMark, prev)) != string::npos;) {
+      resolved.append(code_, prev, i - prev);
+      resolved += codes[atoi(code_.c_str() + i + 1)];
+      prev = code_.find(kIntMark, i + 1) + 1;
+    }
+    resolved.append(code_, prev, string::npos);
+    code_.swap(resolved);
+  }
+
+  // Instead of storing the value |inst| left on the stack, keeps it there
+  // for the next instruction, which usually takes it as its first or
+  // second operand. Values used only there are never stored, and others
+  // are stored from a copy made with ':'. Only the next instruction gets
+  // a value this way: reusing it later with ':' and '\' would need the
+  // depth of each value on the stack tracked across instructions, so the
+  // later uses load it from its register or the frame.
+  void deferSet(const Instruction& inst) {
+    pending_ = &inst;
+    pending_at_ = code_.size();
+    one_get_end_ = string::npos;
+  }
+
+  // Stores the value deferSet() kept, as if it had been stored right when
+  // it was made.
+  void flushPending() {
+    if (!pending_)
+      return;
+    code_.insert(pending_at_, setCode(*pending_));
+    pending_ = NULL;
+  }
+
+  // Whether the next instruction hasn't pushed anything since deferSet().
+  bool pendingOnTop() const {
+    return pending_ && code_.find_first_not_of(' ', pending_at_) == string::npos;
+  }
+
+  // Leaves |v| on the top of the stack if it is what deferSet() kept and
+  // is under at most the one operand pushed since.
+  bool takePending(const Value* v) {
+    if (v != pending_)
+      return false;
+    bool on_top = pendingOnTop();
+    if (!on_top && code_.size() != one_get_end_)
+      return false;
+    if (!stack_values_.count(v))
+      code_.insert(pending_at_, ":" + setCode(*v));
+    if (!on_top)
+      code_ += '\\';
+    pending_ = NULL;
+    return true;
+  }
+
+  string setCode(const Value& v) {
+    string code;
+    code.swap(code_);
+    set(LOCAL, getInstId(v));
+    code.swap(code_);
+    return code;
   }
 
   void getLocal(const Value* v) {
+    if (takePending(v))
+      return;
+    if (v == pending_)
+      flushPending();
+    bool first = pendingOnTop();
+    loadLocal(v);
+    one_get_end_ = first ? code_.size() : string::npos;
+  }
+
+  void loadLocal(const Value* v) {
+    // Such as a bitcast of a global.
+    if (isa<ConstantExpr>(v))
+      v = v->stripPointerCasts();
     auto found = global_map_.find(v);
     if (found != global_map_.end()) {
       genInt(found->second);
-    } else if (auto cv = dynamic_cast<const ConstantInt*>(v)) {
+    } else if (auto cv = dyn_cast<ConstantInt>(v)) {
       int c = cv->getLimitedValue();
       genInt(c);
-    } else if (dynamic_cast<const ConstantPointerNull*>(v)) {
+    } else if (isa<ConstantPointerNull>(v)) {
       genInt(0);
     } else {
       int id = getInstId(*v);
@@ -854,6 +1740,18 @@ private:
     code_ += "10p";
   }
 
+  // Cells for calloc() and free() to keep values in, before the
+  // registers.
+  void getTemp(int i) {
+    genInt(3 + i);
+    code_ += "0g";
+  }
+
+  void setTemp(int i) {
+    genInt(3 + i);
+    code_ += "0p";
+  }
+
   void getLocalPointer() {
     code_ += "20g";
   }
@@ -865,12 +1763,9 @@ private:
   void addr(MemType mt, int id) {
     if (mt == LOCAL) {
       if (id < 0) {
-        int reg = 2 - id;
-        int y = reg % 2;
-        int x = reg / 2 + 3;
-        assert(x < 80);
-        genInt(x);
-        genInt(y);
+        assert(isRegister(id));
+        genInt(regX(id));
+        genInt(regY(id));
       } else {
         getLocalPointer();
         genInt(id);
@@ -884,6 +1779,18 @@ private:
     }
   }
 
+  // Registers are the cells of rows 0 and 1 from column 5, by negative
+  // ids from -3.
+  static bool isRegister(int id) { return id <= -3 && regX(id) < 80; }
+  static int regX(int id) { return (2 - id) / 2 + 3; }
+  static int regY(int id) { return (2 - id) % 2; }
+
+  // The code which does |op| on the register |id|, for the code of
+  // resolveConstants(), which has no marks of genInt().
+  static string regCode(int id, char op) {
+    return intProgram(regX(id)) + intProgram(regY(id)) + op;
+  }
+
   void get(MemType mt, int id) {
     addr(mt, id);
     code_ += 'g';
@@ -906,20 +1813,56 @@ private:
   map<const Function*, int> func_map_;
   map<const Function*, int> local_size_map_;
   vector<string> bef_;
+  // Values whose only use is the instruction right after them.
+  std::set<const Value*> stack_values_;
+  // The value deferSet() kept on the stack, and where in |code_| it was.
+  const Value* pending_;
+  size_t pending_at_;
+  // The end of the first operand pushed after |pending_|, if it is the
+  // end of |code_|.
+  size_t one_get_end_;
+  // Registers from this one down aren't used by any block.
+  int first_free_reg_;
+  // What resolveConstants() has emitted: the constants, the cells for
+  // them, the cells base9Int() would have taken, and how many constants
+  // it loads from registers.
+  int num_ints_;
+  int int_cells_;
+  int base9_cells_;
+  int num_hoisted_;
+  // The rewrites of peephole() and the cells they saved.
+  int num_rewrites_;
+  int rewrite_cells_;
+  int num_inlined_;
+  int num_tail_calls_;
+  // Whether the program calls free(), and the sizes of blocks it may
+  // free, by size class. The lists of other sizes stay empty, so
+  // calloc() takes a new block for them.
+  bool uses_free_;
+  vector<bool> freed_sizes_;
+  // The first row of each block with -l, by id.
+  vector<int> lane_rows_;
   int stack_size_;
 };
 
 int main(int argc, char* argv[]) {
   const char* arg0 = argv[0];
 
-  if (!strcmp(argv[1], "-g")) {
-    is_debug = true;
+  while (argc >= 2 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-g")) {
+      is_debug = true;
+    } else if (!strcmp(argv[1], "-l")) {
+      use_lanes = true;
+    } else {
+      fprintf(stderr, "unknown switch %s\n", argv[1]);
+      return 1;
+    }
     argc--;
     argv++;
   }
 
   if (argc < 1) {
-    fprintf(stderr, "Usage: %s bitcode\n", arg0);
+    fprintf(stderr, "Usage: %s [-g] [-l] bitcode\n", arg0);
     return 1;
   }
 
@@ -929,7 +1872,12 @@ int main(int argc, char* argv[]) {
     fprintf(stderr, "Failed to read %s: %s\n", argv[1], ec.message().c_str());
   }
 
+#if LLVM_VERSION_MAJOR >= 14
+  unique_ptr<Module> module =
+      cantFail(parseBitcodeFile(buf.get()->getMemBufferRef(), context));
+#else
   auto module = parseBitcodeFile(buf.get()->getMemBufferRef(), context);
+#endif
   fprintf(stderr, "%p\n", module.get());
 
   B2B b2b(module.get());
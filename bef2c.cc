@@ -0,0 +1,1385 @@
+// Compiles a Befunge program into C, for programs which never change the
+// cells they run, such as what bc2bef generates.
+//
+// This walks every state the IP can reach from the top left: its cell,
+// direction, and whether it is in string mode. Each state becomes a
+// label, and straight runs of states are emitted one after another with
+// the values they push kept in C variables. The states between two
+// dispatchers of bc2bef go into a C function of their own, and a chain of
+// dispatchers becomes a jump through a table. The compiled program only
+// does what the Befunge one does while no 'p' changes a cell run after
+// it, or the size of a row or the height which a later step depends on.
+// The walk notes what each state depends on, so:
+//
+// - A cell which 'p' with constant coordinates may write before it runs
+//   is checked where it runs, and a step which depends on the size of a
+//   row 'p' may grow checks that size.
+// - Other 'p' can't be checked before running, as bc2bef computes the
+//   addresses of its memory. These check the cells run by the states
+//   after any of them.
+//
+// The compiled program stops with an error where a check fails. -s
+// instead refuses to compile a program unless no 'p' can change what
+// runs, which bc2bef output never passes for its memory.
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "libbefunge.h"
+
+using namespace std;
+
+enum { DIR_E, DIR_W, DIR_S, DIR_N };
+static const int kDx[4] = { 1, -1, 0, 0 };
+static const int kDy[4] = { 0, 0, 1, -1 };
+
+struct State {
+  int x, y;
+  int dir;
+  bool str;
+};
+
+// A step depends on the size of |row| staying at most |x|. |row| is -1
+// for the height, when no row below the program may reach |x|.
+struct Dep {
+  int row;
+  int x;
+};
+
+// The Befunge space as loaded.
+class Space {
+public:
+  explicit Space(const vector<string>& lines)
+    : lines_(lines), w_(0), h_(lines.size()) {
+    for (const string& l : lines)
+      w_ = max<int>(w_, l.size());
+  }
+
+  int width() const { return w_; }
+  int height() const { return h_; }
+  const vector<string>& lines() const { return lines_; }
+
+  int rowSize(int y) const { return lines_[y].size(); }
+
+  // What befunge fetches at (|x|, |y|), and what '"' reads there.
+  int cell(int x, int y) const {
+    return x >= 0 && x < rowSize(y) ? (char)lines_[y][x] : 0;
+  }
+
+  // Moves (|x|, |y|) a step towards |dir| as befunge does, and adds what
+  // the step depends on to |deps| unless it is NULL.
+  void step(int* x, int* y, int dir, vector<Dep>* deps) const {
+    if (kDx[dir]) {
+      int size = rowSize(*y);
+      *x += kDx[dir];
+      if (*x < 0 || *x >= size) {
+        *x = *x < 0 ? size - 1 : 0;
+        note(deps, *y, size);
+      }
+      return;
+    }
+    for (int ny = *y;;) {
+      ny += kDy[dir];
+      if (ny < 0) {
+        // The IP goes to the bottom row whatever its size, so any new
+        // row moves it.
+        note(deps, -1, 0);
+        *y = h_ - 1;
+        return;
+      }
+      if (ny >= h_) {
+        note(deps, -1, *x);
+        *y = 0;
+        return;
+      }
+      if (*x < rowSize(ny)) {
+        *y = ny;
+        return;
+      }
+      note(deps, ny, *x);
+    }
+  }
+
+private:
+  static void note(vector<Dep>* deps, int row, int x) {
+    if (deps) {
+      Dep d = { row, max(x, 0) };
+      deps->push_back(d);
+    }
+  }
+
+  vector<string> lines_;
+  int w_;
+  int h_;
+};
+
+// The block dispatchers bc2bef puts in front of each block, found as
+// befunge's Dispatcher does:
+//
+//   >:#v_ >$  <code of the block>
+//   v-1<>  1+^
+//   v   ^_^#:<
+//
+// The IP walks down column 0 or up column 9 through a chain of them, one
+// block at a time, until the id on the stack is 0. A chain compiles into
+// a jump through a table of the blocks instead.
+class Dispatchers {
+public:
+  static const int kWidth = 10;
+
+  explicit Dispatchers(const vector<string>& lines) {
+    static const char* const kRows[3] = {
+      ">:#v_ >$  ", "v-1<>  1+^", "v   ^_^#:<",
+    };
+    top_.assign(lines.size(), -1);
+    for (size_t y = 0; y + 2 < lines.size(); y++) {
+      bool ok = true;
+      for (int i = 0; i < 3; i++)
+        ok &= lines[y + i].compare(0, kWidth, kRows[i]) == 0;
+      if (!ok)
+        continue;
+      bool chained = !rows_.empty();
+      for (size_t y2 = rows_.empty() ? y : rows_.back() + 3; y2 < y; y2++) {
+        const string& l = lines[y2];
+        if ((l.size() > 0 && l[0] != ' ' && l[0] != 'v') ||
+            (l.size() > kWidth - 1 && l[kWidth - 1] != ' ' &&
+             l[kWidth - 1] != '^')) {
+          chained = false;
+        }
+      }
+      top_[y] = rows_.size();
+      first_.push_back(chained ? first_.back() : rows_.size());
+      rows_.push_back(y);
+      y += 2;
+    }
+    last_.resize(rows_.size());
+    for (size_t i = rows_.size(); i--;) {
+      last_[i] = (i + 1 < rows_.size() && first_[i + 1] == first_[i] ?
+                  last_[i + 1] : i);
+    }
+  }
+
+  int size() const { return rows_.size(); }
+  int row(int g) const { return rows_[g]; }
+  int first(int g) const { return first_[g]; }
+  int last(int g) const { return last_[g]; }
+
+  // The dispatcher which the IP at (|x|, |y|) enters, going down from
+  // its top left or up from its bottom right, or -1.
+  int entry(int x, int y) const {
+    if ((unsigned)y >= top_.size())
+      return -1;
+    if (x == 0)
+      return top_[y];
+    if (x == kWidth - 1 && y >= 2)
+      return top_[y - 2];
+    return -1;
+  }
+
+  // The last dispatcher at or above row |y|, or -1.
+  int above(int y) const {
+    return upper_bound(rows_.begin(), rows_.end(), y) - rows_.begin() - 1;
+  }
+
+  // The rows from the first of the chain of |g| to its last.
+  int beginRow(int g) const { return rows_[first_[g]]; }
+  int endRow(int g) const { return rows_[last_[g]] + 3; }
+
+private:
+  // The top row of each dispatcher.
+  vector<int> rows_;
+  // The index of the dispatcher at each row, or -1.
+  vector<int> top_;
+  // The first and last dispatchers chained with each.
+  vector<int> first_;
+  vector<int> last_;
+};
+
+// The C runtime the states are compiled against. The grid is the same as
+// befunge's: the program in a dense array, and the rest in tiles found
+// through a hash.
+static const char kRuntime[] = R"(
+#define TILE_BITS 5
+#define TILE_SIZE (1 << TILE_BITS)
+
+static int cells[W * H];
+/* The stack pointer while main() goes between the functions. */
+static int* sp_;
+static int* stack_base;
+static int* stack_limit;
+
+struct tile {
+  unsigned long long key;
+  int* cells;
+};
+static struct tile* tiles;
+static size_t tile_count;
+static size_t tile_cap;
+/* The tiles used last, by the low bits of their rows. */
+#define CACHE_SIZE 64
+static struct tile cache[CACHE_SIZE];
+
+static inline unsigned long long tile_key(int x, int y) {
+  return (unsigned long long)(y >> TILE_BITS) << 32 |
+         (unsigned)(x >> TILE_BITS);
+}
+
+static inline struct tile* cache_slot(unsigned long long key) {
+  return &cache[(key ^ key >> 32) & (CACHE_SIZE - 1)];
+}
+
+static inline size_t tile_hash(unsigned long long key) {
+  unsigned long long h = key * 0x9e3779b97f4a7c15ULL;
+  return (h ^ h >> 32) & (tile_cap - 1);
+}
+
+static int* find_tile(int x, int y, int create) {
+  unsigned long long key = tile_key(x, y);
+  size_t i = 0;
+  if (tile_cap) {
+    for (i = tile_hash(key);
+         tiles[i].cells; i = (i + 1) & (tile_cap - 1)) {
+      if (tiles[i].key == key) {
+        *cache_slot(key) = tiles[i];
+        return tiles[i].cells;
+      }
+    }
+  }
+  if (!create)
+    return NULL;
+  if ((tile_count + 1) * 2 > tile_cap) {
+    struct tile* old = tiles;
+    size_t old_cap = tile_cap;
+    tile_cap = tile_cap ? tile_cap * 2 : 64;
+    tiles = calloc(tile_cap, sizeof(*tiles));
+    for (size_t j = 0; j < old_cap; j++) {
+      if (!old[j].cells)
+        continue;
+      for (i = tile_hash(old[j].key);
+           tiles[i].cells; i = (i + 1) & (tile_cap - 1)) {
+      }
+      tiles[i] = old[j];
+    }
+    free(old);
+    for (i = tile_hash(key);
+         tiles[i].cells; i = (i + 1) & (tile_cap - 1)) {
+    }
+  }
+  tiles[i].key = key;
+  tiles[i].cells = calloc(TILE_SIZE * TILE_SIZE, sizeof(int));
+  tile_count++;
+  *cache_slot(key) = tiles[i];
+  return tiles[i].cells;
+}
+
+static inline int* tile_of(int x, int y, int create) {
+  unsigned long long key = tile_key(x, y);
+  struct tile* c = cache_slot(key);
+  if (c->cells && c->key == key)
+    return c->cells;
+  return find_tile(x, y, create);
+}
+
+static inline int tile_index(int x, int y) {
+  return (y & (TILE_SIZE - 1)) << TILE_BITS | (x & (TILE_SIZE - 1));
+}
+
+static inline int get_cell(int x, int y) {
+  if ((unsigned)x < W && (unsigned)y < H)
+    return cells[y * W + x];
+  if (x < 0 || y < 0)
+    return 0;
+  int* t = tile_of(x, y, 0);
+  return t ? t[tile_index(x, y)] : 0;
+}
+
+/* The sizes of the rows of the program as 'p' grows them, and how far
+   the rows below it reach. Steps which depend on these check them. */
+static int sizes[H];
+static int beyond_width;
+/* Whether a row of the program has grown, which stops going through the
+   dispatchers at once. */
+static int grown;
+
+static inline void put_cell(int x, int y, int v) {
+  if (y < H) {
+    if (x >= sizes[y]) {
+      sizes[y] = x + 1;
+      grown = 1;
+    }
+    if (x < W) {
+      cells[y * W + x] = v;
+      return;
+    }
+  } else if (x >= beyond_width) {
+    beyond_width = x + 1;
+  }
+  tile_of(x, y, 1)[tile_index(x, y)] = v;
+}
+
+static int fail(int status) {
+  fflush(stdout);
+  exit(status);
+  return status;
+}
+
+static inline int changed(int x, int y) {
+  fprintf(stderr, "the program changed where bef2c compiled it as it was "
+          "@%d,%d\n", x, y);
+  return fail(1);
+}
+
+/* 'p' whose coordinates are only known here. */
+static inline void put_checked(int x, int y, int v) {
+  if (x < 0 || y < 0) {
+    fprintf(stderr, "negative 'p' isn't supported x=%d y=%d\n", x, y);
+    fail(1);
+  }
+  if (x < W && y < H && exec_bits[(y * W + x) >> 3] >> ((y * W + x) & 7) & 1)
+    changed(x, y);
+  put_cell(x, y, v);
+}
+
+static inline int* grow_stack(int* sp, size_t n) {
+  size_t size = sp - stack_base;
+  size_t cap = (stack_limit - stack_base) * 2;
+  while (cap < size + n)
+    cap *= 2;
+  stack_base = realloc(stack_base, cap * sizeof(int));
+  stack_limit = stack_base + cap;
+  return stack_base + size;
+}
+
+/* Makes room for |n| more values on the stack. */
+#define RESERVE(n)                              \
+  do {                                          \
+    if (stack_limit - sp < (n))                 \
+      sp = grow_stack(sp, (n));                 \
+  } while (0)
+#define POP() (sp != stack_base ? *--sp : 0)
+#define TOP() (sp != stack_base ? sp[-1] : 0)
+/* Goes to a state emitted into another function. */
+#define JUMP(e)                                 \
+  do {                                          \
+    int e_ = (e);                               \
+    sp_ = sp;                                   \
+    return e_;                                  \
+  } while (0)
+#define ADD(a, b) ((int)((unsigned)(a) + (unsigned)(b)))
+#define SUB(a, b) ((int)((unsigned)(a) - (unsigned)(b)))
+#define MUL(a, b) ((int)((unsigned)(a) * (unsigned)(b)))
+
+static int interactive;
+
+static inline int get_char(void) {
+  if (interactive)
+    fflush(stdout);
+  return getchar_unlocked();
+}
+
+/* Like scanf("%d"), as befunge reads it. */
+static inline int get_int(void) {
+  int c;
+  do {
+    c = get_char();
+  } while (c == ' ' || (c >= '\t' && c <= '\r'));
+  int neg = 0;
+  if (c == '-' || c == '+') {
+    neg = c == '-';
+    c = get_char();
+  }
+  if (c < '0' || c > '9') {
+    ungetc(c, stdin);
+    return -1;
+  }
+  unsigned u = 0;
+  do {
+    u = u * 10 + c - '0';
+    c = get_char();
+  } while (c >= '0' && c <= '9');
+  ungetc(c, stdin);
+  return neg ? (int)(0u - u) : (int)u;
+}
+
+static inline void put_int(int v) {
+  printf("*%d*\n", v);
+}
+
+static inline int unsupported(int op, int x, int y) {
+  fprintf(stderr, "this implementation doesn't support '%c' (%d) @%d,%d\n",
+          (char)op, (char)op, x, y);
+  return fail(1);
+}
+
+static int* init(void) {
+  for (int y = 0; y < H; y++) {
+    sizes[y] = row_sizes[y];
+    for (int x = 0; x < row_sizes[y]; x++)
+      cells[y * W + x] = (char)rows[y][x];
+  }
+  stack_base = malloc(1024 * sizeof(int));
+  stack_limit = stack_base + 1024;
+  srand(time(NULL));
+  interactive = isatty(0);
+  return stack_base;
+}
+)";
+
+
+// Lists of ints for each of a number of keys, built from pairs.
+class Index {
+public:
+  void build(size_t keys, vector<pair<int, int> >* pairs) {
+    sort(pairs->begin(), pairs->end());
+    start_.assign(keys + 1, 0);
+    values_.resize(pairs->size());
+    for (size_t i = 0; i < pairs->size(); i++) {
+      start_[(*pairs)[i].first + 1]++;
+      values_[i] = (*pairs)[i].second;
+    }
+    for (size_t k = 0; k < keys; k++)
+      start_[k + 1] += start_[k];
+  }
+
+  const int* begin(int k) const { return &values_[0] + start_[k]; }
+  const int* end(int k) const { return &values_[0] + start_[k + 1]; }
+
+private:
+  vector<int> start_;
+  vector<int> values_;
+};
+
+class Compiler {
+public:
+  Compiler(const Space& space, bool strict)
+    : space_(space), dispatchers_(space.lines()), strict_(strict),
+      failed_(false), planning_(false), func_(0), code_(NULL), temps_(0) {
+  }
+
+  // Finds the states, how they go to each other, and what each depends
+  // on. Returns false if the program is empty.
+  bool walk() {
+    if (!space_.height())
+      return false;
+    State entry = { 0, 0, DIR_E, false };
+    id(entry);
+    vector<pair<int, int> > succs;
+    vector<pair<int, int> > cells;
+    vector<pair<int, int> > rows;
+    for (size_t i = 0; i < states_.size(); i++) {
+      State s = states_[i];
+      if (s.x >= 0 && s.x < space_.width())
+        cells.push_back(make_pair(s.y * space_.width() + s.x, i));
+      vector<Dep> deps[4];
+      State next[4];
+      int n = successors(s, next, deps);
+      for (int j = 0; j < n; j++) {
+        succs.push_back(make_pair(i, id(next[j])));
+        for (const Dep& d : deps[j]) {
+          deps_.push_back(make_pair(i, d));
+          if (d.row >= 0)
+            rows.push_back(make_pair(d.row, deps_.size() - 1));
+          else
+            beyond_.push_back(deps_.size() - 1);
+        }
+      }
+    }
+    size_t n = states_.size();
+    preds_.assign(n, 0);
+    vector<pair<int, int> > preds;
+    for (auto& e : succs) {
+      preds.push_back(make_pair(e.second, e.first));
+      preds_[e.second]++;
+    }
+    succ_index_.build(n, &succs);
+    pred_index_.build(n, &preds);
+    cell_index_.build((size_t)space_.width() * space_.height(), &cells);
+    row_index_.build(space_.height(), &rows);
+
+    // The 'v' at the bottom left of a dispatcher turns the IP down
+    // whichever way it came.
+    escapes_.assign(n, false);
+    for (int g = 0; g < dispatchers_.size(); g++) {
+      int r = dispatchers_.row(g);
+      for (int dir = 0; dir < 4; dir++) {
+        State up = { Dispatchers::kWidth - 1, r, dir, false };
+        State down = { 0, r + 2, dir, false };
+        int i = dispatchers_.first(g) == g && dir == DIR_N ? find(up) : -1;
+        int j = dispatchers_.last(g) == g ? find(down) : -1;
+        if (i >= 0)
+          escapes_[i] = true;
+        if (j >= 0)
+          escapes_[j] = true;
+      }
+    }
+    return true;
+  }
+
+  // Writes the C program. With -s, returns false instead if it can't be
+  // shown that no 'p' changes what runs.
+  bool emit(FILE* fp, const char* src) {
+    // The first pass finds what 'p' writes, which decides what the
+    // second one checks.
+    string code;
+    planning_ = true;
+    watched_.assign((size_t)space_.width() * space_.height(), false);
+    findStarts();
+    generate(&code);
+    if (failed_)
+      return false;
+    planning_ = false;
+    generate(&code);
+
+    fprintf(fp, "/* Generated by bef2c from %s. */\n\n", src);
+    fprintf(fp, "#define _POSIX_C_SOURCE 200809L\n\n");
+    fprintf(fp, "#include <stdio.h>\n#include <stdlib.h>\n"
+            "#include <time.h>\n#include <unistd.h>\n\n");
+    fprintf(fp, "#define W %d\n#define H %d\n", space_.width(),
+            space_.height());
+    emitTables(fp);
+    fputs(kRuntime, fp);
+    fputs(code.c_str(), fp);
+    if (!dynamic_puts_.empty()) {
+      fprintf(stderr, "%s: %d 'p' checked at runtime\n", src,
+              (int)dynamic_puts_.size());
+    }
+    return true;
+  }
+
+private:
+  // A value on the stack as C: a constant or a variable.
+  struct Value {
+    bool known;
+    int v;
+    string c;
+  };
+
+  // Emits the states into C functions, one for the rows from each
+  // dispatcher down to the next, in which they go to each other with
+  // goto. Going to a state in another function returns its entry to
+  // main(), which calls that function with it.
+  void generate(string* code) {
+    temps_ = 0;
+    emitted_.assign(states_.size(), false);
+    queued_.assign(states_.size(), false);
+    funcs_.assign(dispatchers_.size() + 1, string());
+    entries_.clear();
+    entry_of_.assign(states_.size(), -1);
+    entry(0);
+    for (int g = 0; g < dispatchers_.size(); g++) {
+      if (blocks_[g] >= 0)
+        entry(blocks_[g]);
+    }
+    queue(0);
+    while (!queue_.empty()) {
+      int i = queue_.back();
+      queue_.pop_back();
+      emitBlock(i);
+    }
+
+    *code = "";
+    if (dispatchers_.size()) {
+      *code += "\nstatic const int blocks[] = {";
+      for (int g = 0; g < dispatchers_.size(); g++) {
+        *code += g % 16 ? " " : "\n  ";
+        *code += to_string(blocks_[g] >= 0 ? entry_of_[blocks_[g]] : -1) +
+                 ",";
+      }
+      *code += "\n};\n";
+    }
+    vector<vector<int> > entries(funcs_.size());
+    for (size_t e = 0; e < entries_.size(); e++)
+      entries[func(entries_[e])].push_back(e);
+    for (size_t f = 0; f < funcs_.size(); f++) {
+      if (funcs_[f].empty())
+        continue;
+      *code += "\nstatic int f" + to_string(f) + "(int entry) {\n";
+      *code += "  int* sp = sp_;\n";
+      if (!usesStack(funcs_[f]))
+        *code += "  (void)sp;\n";
+      *code += "  switch (entry) {\n";
+      for (size_t k = 0; k < entries[f].size(); k++) {
+        int e = entries[f][k];
+        *code += k + 1 < entries[f].size() ?
+            "  case " + to_string(e) + ":" : string("  default:");
+        *code += " goto " + label(entries_[e]) + ";\n";
+      }
+      *code += "  }\n" + funcs_[f] + "}\n";
+    }
+    *code += "\nstatic int (*const entries[])(int) = {";
+    for (size_t e = 0; e < entries_.size(); e++) {
+      *code += e % 8 ? " " : "\n  ";
+      *code += "f" + to_string(func(entries_[e])) + ",";
+    }
+    *code += "\n};\n";
+    *code += "\nint main(void) {\n";
+    *code += "  sp_ = init();\n";
+    *code += "  for (int e = 0;;)\n";
+    *code += "    e = entries[e](e);\n";
+    *code += "}\n";
+  }
+
+  static bool usesStack(const string& c) {
+    static const char* const kUses[] = { "sp", "POP()", "TOP()", "JUMP(" };
+    for (const char* u : kUses) {
+      if (c.find(u) != string::npos)
+        return true;
+    }
+    return false;
+  }
+
+  // The function state |i| is emitted into.
+  int func(int i) const {
+    return dispatchers_.above(states_[i].y) + 1;
+  }
+
+  // The entry of state |i|, which main() calls its function with.
+  int entry(int i) {
+    if (entry_of_[i] < 0) {
+      entry_of_[i] = entries_.size();
+      entries_.push_back(i);
+    }
+    return entry_of_[i];
+  }
+
+  // Goes to state |j|.
+  string jump(int j) {
+    queue(j);
+    if (func(j) == func_)
+      return "goto " + label(j) + ";";
+    return "JUMP(" + to_string(entry(j)) + ");";
+  }
+
+  // Finds the entries of the dispatchers and the blocks after them, which
+  // start blocks of C so that they can be gone to from anywhere.
+  void findStarts() {
+    starts_.assign(states_.size(), false);
+    blocks_.assign(dispatchers_.size(), -1);
+    for (int g = 0; g < dispatchers_.size(); g++) {
+      State b = { 8, dispatchers_.row(g), DIR_E, false };
+      int i = find(b);
+      if (i >= 0)
+        starts_[blocks_[g] = i] = true;
+    }
+    for (size_t i = 0; i < states_.size(); i++) {
+      const State& s = states_[i];
+      if (!s.str && dispatchers_.entry(s.x, s.y) >= 0)
+        starts_[i] = true;
+    }
+  }
+
+  // Whether the chain of dispatcher |g| can be gone through at once: each
+  // of its blocks is reached, and no 'p' changes the cells of the
+  // dispatchers. Rows growing are checked at runtime.
+  bool canDispatch(int g) {
+    int f = dispatchers_.first(g);
+    for (int h = f; h <= dispatchers_.last(f); h++) {
+      if (blocks_[h] < 0)
+        return false;
+    }
+    for (int y = dispatchers_.beginRow(g); y < dispatchers_.endRow(g); y++) {
+      for (int x = 0; x < Dispatchers::kWidth && x < space_.width(); x++) {
+        if (watched_[y * space_.width() + x])
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // Goes from the dispatcher state |i| enters to its block through
+  // |blocks|, if the id on the stack is one it would reach.
+  void emitDispatch(int i) {
+    const State& s = states_[i];
+    int g = dispatchers_.entry(s.x, s.y);
+    if (planning_ || g < 0 || s.str || !canDispatch(g))
+      return;
+    string k = to_string(g - dispatchers_.first(g));
+    // Going down, the id counts the dispatchers after this one, and going
+    // up, those before it.
+    string in_range = s.x == 0 ?
+        "(unsigned)TOP() <= " + to_string(dispatchers_.last(g) - g) :
+        "(unsigned)ADD(TOP(), " + k + ") <= " + k;
+    line("if (!grown && " + in_range + ")");
+    line("  JUMP(blocks[ADD(POP(), " + to_string(g) + ")]);");
+  }
+
+  int find(const State& s) const {
+    auto found = ids_.find(key(s));
+    return found == ids_.end() ? -1 : found->second;
+  }
+
+  int64_t key(const State& s) const {
+    return ((((int64_t)s.y * (space_.width() + 1) + s.x + 1) * 4 +
+             s.dir) << 1) | s.str;
+  }
+
+  int id(const State& s) {
+    int found = find(s);
+    if (found >= 0)
+      return found;
+    int i = states_.size();
+    ids_[key(s)] = i;
+    states_.push_back(s);
+    return i;
+  }
+
+  State stepped(const State& s, int dir, bool str, vector<Dep>* deps) {
+    State n = { s.x, s.y, dir, str };
+    space_.step(&n.x, &n.y, dir, deps);
+    return n;
+  }
+
+  // The states which can follow |s|. What the step to next[j] depends on
+  // is added to deps[j] unless |deps| is NULL. A branch lists the state
+  // for a non-zero value first, and '?' lists them in the order of
+  // befunge's switch.
+  int successors(const State& s, State* next, vector<Dep>* deps) {
+    vector<Dep>* d0 = deps ? &deps[0] : NULL;
+    vector<Dep>* d1 = deps ? &deps[1] : NULL;
+    int op = space_.cell(s.x, s.y);
+    if (s.str) {
+      next[0] = stepped(s, s.dir, op != '"', d0);
+      return 1;
+    }
+    switch (op) {
+    case '<': next[0] = stepped(s, DIR_W, false, d0); return 1;
+    case '>': next[0] = stepped(s, DIR_E, false, d0); return 1;
+    case '^': next[0] = stepped(s, DIR_N, false, d0); return 1;
+    case 'v': next[0] = stepped(s, DIR_S, false, d0); return 1;
+    case '_':
+      next[0] = stepped(s, DIR_W, false, d0);
+      next[1] = stepped(s, DIR_E, false, d1);
+      return 2;
+    case '|':
+      next[0] = stepped(s, DIR_N, false, d0);
+      next[1] = stepped(s, DIR_S, false, d1);
+      return 2;
+    case '?':
+      for (int d = 0; d < 4; d++)
+        next[d] = stepped(s, d, false, deps ? &deps[d] : NULL);
+      return 4;
+    case '#':
+      next[0] = stepped(stepped(s, s.dir, false, d0), s.dir, false, d0);
+      return 1;
+    case '"':
+      next[0] = stepped(s, s.dir, true, d0);
+      return 1;
+    case '@':
+      return 0;
+    default:
+      if (!isSupported(op))
+        return 0;
+      next[0] = stepped(s, s.dir, false, d0);
+      return 1;
+    }
+  }
+
+  static bool isSupported(int op) {
+    return op > 0 && strchr(" 0123456789&~,.+-*/%`!:\\$gp", op);
+  }
+
+  // Whether a state |p| can reach runs (|x|, |y|).
+  // With |direct|, only by paths which stay in the chains of dispatchers.
+  bool runsAfter(int p, int x, int y, bool direct) {
+    if (y >= space_.height() || x >= space_.width())
+      return false;
+    int c = y * space_.width() + x;
+    int64_t key = (int64_t)c << 1 | direct;
+    auto found = runs_after_.find(key);
+    if (found == runs_after_.end()) {
+      vector<int> seeds(cell_index_.begin(c), cell_index_.end(c));
+      found = runs_after_.emplace(key, reaching(seeds, direct)).first;
+    }
+    return found->second[p];
+  }
+
+  // Whether a step from |p| or a state it can reach depends on
+  // (|x|, |y|) not being written. With |direct|, only by paths which stay
+  // in the chains of dispatchers.
+  bool dependsAfter(int p, int x, int y, bool direct) {
+    int64_t key = ((int64_t)min(y, space_.height()) << 32 | x) << 1 | direct;
+    auto found = depends_after_.find(key);
+    if (found == depends_after_.end()) {
+      vector<int> deps = beyond_;
+      if (y < space_.height())
+        deps.assign(row_index_.begin(y), row_index_.end(y));
+      vector<int> seeds;
+      for (int d : deps) {
+        int s = deps_[d].first;
+        if (x >= deps_[d].second.x && !(direct && escapes_[s]))
+          seeds.push_back(s);
+      }
+      vector<bool> after = reaching(seeds, direct);
+      for (int s : seeds)
+        after[s] = true;
+      found = depends_after_.emplace(key, after).first;
+    }
+    return found->second[p];
+  }
+
+  // The states with a path of a step or more to one of |seeds|, which
+  // doesn't leave a chain of dispatchers if |direct|.
+  vector<bool> reaching(const vector<int>& seeds, bool direct) {
+    vector<bool> after(states_.size(), false);
+    vector<int> todo(seeds);
+    while (!todo.empty()) {
+      int s = todo.back();
+      todo.pop_back();
+      for (const int* q = pred_index_.begin(s); q != pred_index_.end(s);
+           q++) {
+        if (!after[*q] && !(direct && escapes_[*q])) {
+          after[*q] = true;
+          todo.push_back(*q);
+        }
+      }
+    }
+    return after;
+  }
+
+  // Writes the program as loaded, and the cells run by the states after
+  // 'p' whose coordinates are only known at runtime.
+  void emitTables(FILE* fp) {
+    const vector<string>& lines = space_.lines();
+    fprintf(fp, "static const char* const rows[H] = {\n");
+    for (const string& l : lines) {
+      fputs("  \"", fp);
+      for (unsigned char c : l) {
+        if (c == '"' || c == '\\' || c == '?')
+          fprintf(fp, "\\%c", c);
+        else if (c >= 32 && c < 127)
+          fputc(c, fp);
+        else
+          fprintf(fp, "\\%03o", c);
+      }
+      fputs("\",\n", fp);
+    }
+    fprintf(fp, "};\n\n");
+    fprintf(fp, "static const int row_sizes[H] = {");
+    for (size_t y = 0; y < lines.size(); y++)
+      fprintf(fp, "%s%d,", y % 8 ? " " : "\n  ", (int)lines[y].size());
+    fprintf(fp, "\n};\n\n");
+
+    vector<bool> after(states_.size(), false);
+    vector<int> todo;
+    for (int p : dynamic_puts_) {
+      for (const int* q = succ_index_.begin(p); q != succ_index_.end(p);
+           q++) {
+        if (!after[*q]) {
+          after[*q] = true;
+          todo.push_back(*q);
+        }
+      }
+    }
+    while (!todo.empty()) {
+      int s = todo.back();
+      todo.pop_back();
+      for (const int* q = succ_index_.begin(s); q != succ_index_.end(s);
+           q++) {
+        if (!after[*q]) {
+          after[*q] = true;
+          todo.push_back(*q);
+        }
+      }
+    }
+    size_t w = space_.width();
+    vector<bool> exec(w * space_.height(), false);
+    for (size_t i = 0; i < states_.size(); i++) {
+      const State& s = states_[i];
+      if (after[i] && s.x >= 0 && s.x < (int)w)
+        exec[s.y * w + s.x] = true;
+    }
+    fprintf(fp, "static const unsigned char exec_bits[] = {");
+    for (size_t i = 0; i < exec.size(); i += 8) {
+      int b = 0;
+      for (size_t j = 0; j < 8 && i + j < exec.size(); j++)
+        b |= exec[i + j] << j;
+      fprintf(fp, "%s%d,", i % 128 ? "" : "\n  ", b);
+    }
+    fprintf(fp, "\n  0,\n};\n");
+  }
+
+  static string label(int i) {
+    return "s" + to_string(i);
+  }
+
+  void line(const string& s) {
+    *code_ += "  " + s + "\n";
+  }
+
+  void queue(int i) {
+    if (!queued_[i]) {
+      queued_[i] = true;
+      queue_.push_back(i);
+    }
+  }
+
+  // Goes to state |i|, keeping |vals_| only if it comes right here.
+  // Returns true if the state is emitted next, without a label.
+  bool follow(int i) {
+    if (!emitted_[i] && preds_[i] == 1 && i != 0 && !starts_[i])
+      return true;
+    flush();
+    line(jump(i));
+    return false;
+  }
+
+  // Pushes the values held in C to the stack.
+  void flush() {
+    if (vals_.empty())
+      return;
+    line("RESERVE(" + to_string(vals_.size()) + ");");
+    for (size_t k = 0; k < vals_.size(); k++)
+      line("sp[" + to_string(k) + "] = " + vals_[k].c + ";");
+    line("sp += " + to_string(vals_.size()) + ";");
+    vals_.clear();
+  }
+
+  static string literal(int v) {
+    return v == INT_MIN ? "(-2147483647 - 1)" : to_string(v);
+  }
+
+  void pushConst(int v) {
+    Value a = { true, v, literal(v) };
+    vals_.push_back(a);
+  }
+
+  // Evaluates |e| here, and pushes its value.
+  void pushExpr(const string& e) {
+    Value a = { false, 0, "t" + to_string(temps_++) };
+    line("int " + a.c + " = " + e + ";");
+    vals_.push_back(a);
+  }
+
+  Value popValue() {
+    if (vals_.empty())
+      pushExpr("POP()");
+    Value a = vals_.back();
+    vals_.pop_back();
+    return a;
+  }
+
+  // The top of the stack as C, which is a constant if it's known here.
+  string pop(bool* known, int* v) {
+    Value a = popValue();
+    *known = a.known;
+    *v = a.v;
+    return a.c;
+  }
+
+  static bool fold(int op, int a, int b, int* r) {
+    switch (op) {
+    case '+': *r = (int)((unsigned)a + (unsigned)b); return true;
+    case '-': *r = (int)((unsigned)a - (unsigned)b); return true;
+    case '*': *r = (int)((unsigned)a * (unsigned)b); return true;
+    case '/':
+    case '%':
+      // Left for the CPU to trap on as befunge does.
+      if (b == 0 || (a == INT_MIN && b == -1))
+        return false;
+      *r = op == '/' ? a / b : a % b;
+      return true;
+    case '`': *r = a > b; return true;
+    }
+    return false;
+  }
+
+  static string binary(int op, const string& a, const string& b) {
+    switch (op) {
+    case '+': return "ADD(" + a + ", " + b + ")";
+    case '-': return "SUB(" + a + ", " + b + ")";
+    case '*': return "MUL(" + a + ", " + b + ")";
+    case '/': return a + " / " + b;
+    case '%': return a + " % " + b;
+    default: return a + " > " + b;
+    }
+  }
+
+  static string where(const State& s) {
+    return to_string(s.x) + ", " + to_string(s.y);
+  }
+
+  // Notes 'p' at state |i| writing to (|x|, |y|). The cells it may
+  // change before they run are checked where they run, and the steps
+  // depending on the row it writes check its size, unless -s asks to
+  // refuse the program instead. -s still leaves the checks on the paths
+  // which leave a chain of dispatchers, as the register cells bc2bef
+  // writes in row 0 only run again after that.
+  void planPut(int i, int x, int y) {
+    const State& s = states_[i];
+    puts_.push_back(make_pair(x, y));
+    bool runs = runsAfter(i, x, y, false);
+    if (strict_ && (runsAfter(i, x, y, true) ||
+                    dependsAfter(i, x, y, true))) {
+      fprintf(stderr, "'p' at %d,%d writes to %d,%d, which the program "
+              "may depend on later\n", s.x, s.y, x, y);
+      failed_ = true;
+    } else if (runs) {
+      watched_[y * space_.width() + x] = true;
+    }
+  }
+
+  // Whether some 'p' may write where |d| depends on nothing being.
+  bool mayWrite(const Dep& d) const {
+    if (!dynamic_puts_.empty())
+      return true;
+    for (auto& p : puts_) {
+      bool row = d.row >= 0 ? p.second == d.row : p.second >= space_.height();
+      if (row && p.first >= d.x)
+        return true;
+    }
+    return false;
+  }
+
+  // The code checking what the step from state |i| depends on.
+  vector<string> checks(int i, const vector<Dep>& deps) const {
+    vector<string> r;
+    for (const Dep& d : deps) {
+      if (!mayWrite(d))
+        continue;
+      string size = d.row >= 0 ? "sizes[" + to_string(d.row) + "]"
+                               : string("beyond_width");
+      r.push_back("if (" + size + " > " + to_string(d.x) +
+                  ") return changed(" + where(states_[i]) + ");");
+    }
+    return r;
+  }
+
+  void emitChecks(int i, const vector<Dep>& deps) {
+    for (const string& c : checks(i, deps))
+      line(c);
+  }
+
+  // Goes to state |j| after the step from state |i|.
+  void emitGoto(int i, const vector<Dep>& deps, int j) {
+    vector<string> cs = checks(i, deps);
+    for (const string& c : cs)
+      line("  " + c);
+    line("  " + jump(j));
+  }
+
+  void emitPut(int i) {
+    const State& s = states_[i];
+    bool ky, kx, kv;
+    int y, x, v;
+    string ys = pop(&ky, &y);
+    string xs = pop(&kx, &x);
+    string vs = pop(&kv, &v);
+    if (kx && ky && x >= 0 && y >= 0) {
+      if (planning_)
+        planPut(i, x, y);
+      if (y < space_.height() && x < space_.rowSize(y)) {
+        line("cells[" + to_string(y * space_.width() + x) + "] = " + vs +
+             ";");
+      } else {
+        line("put_cell(" + xs + ", " + ys + ", " + vs + ");");
+      }
+      return;
+    }
+    if (kx && ky) {
+      line("put_checked(" + xs + ", " + ys + ", " + vs + ");");
+      return;
+    }
+    if (planning_) {
+      if (strict_) {
+        fprintf(stderr, "'p' at %d,%d writes to cells only known at "
+                "runtime\n", s.x, s.y);
+        failed_ = true;
+      }
+      dynamic_puts_.push_back(i);
+    }
+    line("put_checked(" + xs + ", " + ys + ", " + vs + ");");
+  }
+
+  void emitGet() {
+    bool ky, kx;
+    int y, x;
+    string ys = pop(&ky, &y);
+    string xs = pop(&kx, &x);
+    if (kx && ky && x >= 0 && y >= 0 && x < space_.width() &&
+        y < space_.height()) {
+      pushExpr("cells[" + to_string(y * space_.width() + x) + "]");
+    } else {
+      pushExpr("get_cell(" + xs + ", " + ys + ")");
+    }
+  }
+
+  // Emits the code of state |i|. Returns false if it doesn't go on to its
+  // only successor.
+  bool emitOp(int i, int op) {
+    if (states_[i].str) {
+      if (op != '"')
+        pushConst(op);
+      return true;
+    }
+    bool ka, kb;
+    int a, b, r;
+    switch (op) {
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      pushConst(op - '0');
+      break;
+    case '+': case '-': case '*': case '/': case '%': case '`': {
+      string bs = pop(&kb, &b);
+      string as = pop(&ka, &a);
+      if (ka && kb && fold(op, a, b, &r))
+        pushConst(r);
+      else
+        pushExpr(binary(op, as, bs));
+      break;
+    }
+    case '!': {
+      string as = pop(&ka, &a);
+      if (ka)
+        pushConst(!a);
+      else
+        pushExpr("!" + as);
+      break;
+    }
+    case ':': {
+      Value v = popValue();
+      vals_.push_back(v);
+      vals_.push_back(v);
+      break;
+    }
+    case '\\': {
+      Value v = popValue();
+      Value u = popValue();
+      vals_.push_back(v);
+      vals_.push_back(u);
+      break;
+    }
+    case '$':
+      if (!vals_.empty())
+        vals_.pop_back();
+      else
+        line("(void)POP();");
+      break;
+    case ',':
+      line("putchar_unlocked((unsigned char)" + pop(&ka, &a) + ");");
+      break;
+    case '.':
+      line("put_int(" + pop(&ka, &a) + ");");
+      break;
+    case '&':
+      pushExpr("get_int()");
+      break;
+    case '~':
+      pushExpr("get_char()");
+      break;
+    case 'g':
+      emitGet();
+      break;
+    case 'p':
+      emitPut(i);
+      break;
+    case '@':
+      line("return fail(0);");
+      return false;
+    case ' ': case '<': case '>': case '^': case 'v': case '#': case '"':
+      break;
+    case '_': case '|': case '?':
+      return false;
+    default:
+      line("return unsupported(" + to_string(op) + ", " +
+           where(states_[i]) + ");");
+      return false;
+    }
+    return true;
+  }
+
+  void emitBranch(int i, int op, State* next, vector<Dep>* deps) {
+    const State& s = states_[i];
+    if (op == '?') {
+      flush();
+      line("switch (rand() / (RAND_MAX / 4)) {");
+      for (int d = 0; d < 4; d++) {
+        line("case " + to_string(d) + ":");
+        emitGoto(i, deps[d], id(next[d]));
+      }
+      // Anything else leaves the direction as it was.
+      line("default:");
+      emitGoto(i, deps[s.dir], id(next[s.dir]));
+      line("}");
+      return;
+    }
+    bool kc;
+    int c;
+    string cs = pop(&kc, &c);
+    flush();
+    if (kc) {
+      int j = c ? 0 : 1;
+      emitChecks(i, deps[j]);
+      line(jump(id(next[j])));
+      return;
+    }
+    int nz = id(next[0]);
+    int z = id(next[1]);
+    if (checks(i, deps[0]).empty()) {
+      line("if (" + cs + ") " + jump(nz));
+    } else {
+      line("if (" + cs + ") {");
+      emitGoto(i, deps[0], nz);
+      line("}");
+    }
+    emitChecks(i, deps[1]);
+    line(jump(z));
+  }
+
+  void emitBlock(int i) {
+    if (emitted_[i])
+      return;
+    func_ = func(i);
+    code_ = &funcs_[func_];
+    vals_.clear();
+    *code_ += label(i) + ": {\n";
+    emitRun(i);
+    *code_ += "}\n";
+  }
+
+  // Emits state |i| and those after it with no other predecessors.
+  void emitRun(int i) {
+    for (;;) {
+      emitted_[i] = true;
+      State s = states_[i];
+      int op = space_.cell(s.x, s.y);
+      State next[4];
+      vector<Dep> deps[4];
+      int n = successors(s, next, deps);
+      int c = s.y * space_.width() + s.x;
+      if (!planning_ && watched_[c]) {
+        line("if (cells[" + to_string(c) + "] != " + to_string(op) +
+             ") return changed(" + where(s) + ");");
+      }
+      emitDispatch(i);
+      if (!emitOp(i, op)) {
+        if (n > 1)
+          emitBranch(i, op, next, deps);
+        return;
+      }
+      emitChecks(i, deps[0]);
+      int j = id(next[0]);
+      if (!follow(j))
+        return;
+      i = j;
+    }
+  }
+
+  const Space& space_;
+  Dispatchers dispatchers_;
+  bool strict_;
+  bool failed_;
+  vector<State> states_;
+  unordered_map<int64_t, int> ids_;
+  Index succ_index_;
+  Index pred_index_;
+  // How many edges go to each state.
+  vector<int> preds_;
+  // The states fetching each cell.
+  Index cell_index_;
+  // What the steps after each state depend on, and their indices by row
+  // and for the height.
+  vector<pair<int, Dep> > deps_;
+  Index row_index_;
+  vector<int> beyond_;
+  // For the cells and rows 'p' writes with constant coordinates, the
+  // states from which that would change what runs.
+  unordered_map<int64_t, vector<bool> > runs_after_;
+  unordered_map<int64_t, vector<bool> > depends_after_;
+  // The states whose step leaves a chain of dispatchers, down from the
+  // bottom of its last one or up from the top of its first. bc2bef only
+  // pushes the ids of blocks in the chain, so it never takes them.
+  vector<bool> escapes_;
+  // What the first pass of emit() finds: the cells 'p' writes with
+  // constant coordinates, those which have to be checked where they run,
+  // and the other 'p'.
+  bool planning_;
+  vector<pair<int, int> > puts_;
+  vector<bool> watched_;
+  vector<int> dynamic_puts_;
+
+  // The states starting blocks of C even with a single predecessor, and
+  // the states of the blocks after the dispatchers.
+  vector<bool> starts_;
+  vector<int> blocks_;
+  // The C of each function, the function being emitted, and the states
+  // main() can go to with their entries.
+  vector<string> funcs_;
+  int func_;
+  vector<int> entries_;
+  vector<int> entry_of_;
+  vector<bool> emitted_;
+  vector<bool> queued_;
+  vector<int> queue_;
+  string* code_;
+  // The values on top of the stack at this point of the block, which are
+  // held in C instead of the stack.
+  vector<Value> vals_;
+  int temps_;
+};
+
+int main(int argc, char* argv[]) {
+  const char* prog = argv[0];
+  const char* out_path = NULL;
+  bool strict = false;
+  while (argc >= 2 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-s")) {
+      strict = true;
+    } else if (!strcmp(argv[1], "-o") && argc >= 3) {
+      out_path = argv[2];
+      argc--;
+      argv++;
+    } else {
+      fprintf(stderr, "unknown switch %s\n", argv[1]);
+      return 1;
+    }
+    argc--;
+    argv++;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "%s [-s] [-o out.c] <src.bef>\n", prog);
+    return 1;
+  }
+
+  FILE* fp = fopen(argv[1], "rb");
+  if (!fp) {
+    fprintf(stderr, "failed to open: %s\n", argv[1]);
+    return 1;
+  }
+  string src;
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    src.append(buf, len);
+  fclose(fp);
+
+  Befunge::Program program(src.data(), src.size());
+  Space space(program.lines());
+  Compiler compiler(space, strict);
+  if (!compiler.walk()) {
+    fprintf(stderr, "%s: empty program\n", argv[1]);
+    return 1;
+  }
+  FILE* out = out_path ? fopen(out_path, "wb") : stdout;
+  if (!out) {
+    fprintf(stderr, "failed to open: %s\n", out_path);
+    return 1;
+  }
+  bool ok = compiler.emit(out, argv[1]);
+  if (out_path)
+    fclose(out);
+  if (!ok) {
+    if (out_path)
+      remove(out_path);
+    return 1;
+  }
+  return 0;
+}
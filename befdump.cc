@@ -0,0 +1,54 @@
+// Shows a snapshot which befunge wrote with --core or --checkpoint, as
+// its dumps would have shown the state then, so a program which fails or
+// hangs far into a run can be looked at without printing all of its
+// space to a terminal.
+//
+//   $ ./befunge --core=core.img -g --dump=ip beflisp.bef < input.l
+//   $ ./befdump --dump=ip,values,heap core.img
+//
+// --dump takes the parts of Befunge::Options::dump_parts, and shows
+// everything without it.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "befunge_io.h"
+#include "libbefunge.h"
+
+using Befunge::Machine;
+using Befunge::Options;
+
+int main(int argc, char* argv[]) {
+  const char* prog = argv[0];
+  Options opts;
+  while (argc >= 2 && argv[1][0] == '-') {
+    if (!strncmp(argv[1], "--dump=", 7)) {
+      opts.dump_parts = argv[1] + 7;
+      if (!Befunge::validDumpParts(opts.dump_parts)) {
+        fprintf(stderr, "unknown dump part in %s\n", argv[1]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "unknown switch %s\n", argv[1]);
+      return 1;
+    }
+    argc--;
+    argv++;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "%s [--dump=PARTS] <core.img>\n", prog);
+    return 1;
+  }
+
+  // The machine never runs, so it has no use for the dispatchers.
+  opts.dispatch = false;
+  Output out;
+  Input in(&out);
+  Machine m(opts, &out, &in);
+  if (!m.restore(argv[1])) {
+    fprintf(stderr, "failed to restore: %s\n", argv[1]);
+    return 1;
+  }
+  m.dump();
+  return 0;
+}
@@ -1,127 +1,217 @@
-// A Funge-98 interpretter only with Befunge-93 operations.
+// The command line front end of libbefunge.
 
-#include <assert.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-#include <stack>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "befunge_io.h"
+#include "libbefunge.h"
+
 using namespace std;
+using Befunge::Machine;
+using Befunge::Options;
+using Befunge::Program;
 
-vector<vector<int> > code;
-int ix, iy;
-int vx, vy;
-vector<int> st;
-volatile bool signaled;
+// The machine SIGUSR1 asks for a checkpoint.
+static Machine* running_machine;
 
-bool debug = false;
-bool verbose = false;
-bool bounce_on_fail_input = false;
+static void handleCheckpointSignal(int) {
+  running_machine->requestCheckpoint();
+}
 
-inline void step() {
-  if (vx) {
-    ix += vx;
-    if (ix < 0)
-      ix = (int)code[iy].size() - 1;
-    else if (ix >= (int)code[iy].size())
-      ix = 0;
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A line of the manifest of --batch.
+struct BatchJob {
+  string prog;
+  string input;
+  string output;
+  // Filled in by the worker.
+  string result;
+  bool ok;
+};
+
+static void runBatchJob(const Options& opts,
+                        const map<string, unique_ptr<Program> >& progs,
+                        BatchJob* job) {
+  auto found = progs.find(job->prog);
+  if (found == progs.end()) {
+    job->result = "failed to open: " + job->prog;
     return;
   }
-
-restep:
-  iy += vy;
-  if (iy < 0) {
-    iy = (int)code.size() - 1;
+  int in_fd = 0;
+  if (job->input != "-") {
+    in_fd = open(job->input.c_str(), O_RDONLY);
+    if (in_fd < 0) {
+      job->result = "failed to open: " + job->input;
+      return;
+    }
   }
-  else if (iy >= (int)code.size()) {
-    iy = 0;
-  } else if (ix >= (int)code[iy].size()) {
-    goto restep;
+  int out_fd = open(job->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out_fd < 0) {
+    if (in_fd)
+      close(in_fd);
+    job->result = "failed to open: " + job->output;
+    return;
   }
-}
 
-inline int get() {
-  assert(iy < (int)code.size());
-  if (ix < (int)code[iy].size())
-    return code[iy][ix];
+  double start = now();
+  int status;
+  {
+    // Jobs reading stdin all share it, so they had better not be many.
+    Output out(out_fd);
+    Input in(&out, in_fd);
+    in.setBatch(true);
+    Machine m(opts, &out, &in);
+    m.load(*found->second);
+    status = m.run();
+    out.flush();
+  }
+  double elapsed = now() - start;
+  if (in_fd)
+    close(in_fd);
+  close(out_fd);
+
+  char buf[64];
+  if (status == Machine::kTimedOut)
+    snprintf(buf, sizeof(buf), "timeout %.3fs", elapsed);
+  else if (status)
+    snprintf(buf, sizeof(buf), "exit=%d %.3fs", status, elapsed);
   else
-    return 0;
+    snprintf(buf, sizeof(buf), "ok %.3fs", elapsed);
+  job->result = buf;
+  job->ok = status == 0;
 }
 
-inline void push(int v) {
-  st.push_back(v);
-}
-
-inline int pop() {
-  if (st.empty())
-    return 0;
-  else {
-    int r = st.back();
-    st.pop_back();
-    return r;
+// Runs the jobs in |manifest| on |nthreads| threads. Each line of the
+// manifest is "PROG INPUT OUTPUT", where INPUT may be "-" for stdin, and
+// '#' starts a comment. Prints a line per job in the order of the
+// manifest, and returns 0 only if every job ended with status 0.
+static int runBatch(const char* manifest, const Options& opts, int nthreads) {
+  FILE* fp = fopen(manifest, "rb");
+  if (!fp) {
+    fprintf(stderr, "failed to open: %s\n", manifest);
+    return 1;
   }
-}
-
-void handleSignal(int) {
-  signaled = true;
-}
-
-static void dump() {
-  //fprintf(stderr, "%sc", "\x1b");
-  fprintf(stderr, "=== MEMORY ===\n");
-  for (int y = 0; y < (int)code.size(); y++) {
-    for (int x = 0; x < (int)code[y].size(); x++) {
-      char c = code[y][x];
-      bool color = true;
-      if (x == ix && y == iy) {
-        fprintf(stderr, "\x1b[41m");
-      } else if (c < 32) {
-        fprintf(stderr, "\x1b[30m\x1b[47m");
-        c = c < 10 ? '0' + c : 'A' + c - 10;
-      } else {
-        color = false;
-      }
-      fputc(c, stderr);
-      if (color) {
-        fprintf(stderr, "\x1b[39m");
-        fprintf(stderr, "\x1b[49m");
-      }
+  vector<BatchJob> jobs;
+  char line[4096];
+  for (int lineno = 1; fgets(line, sizeof(line), fp); lineno++) {
+    if (char* p = strchr(line, '#'))
+      *p = '\0';
+    char prog[1024], input[1024], output[1024], extra[2];
+    int n = sscanf(line, "%1023s %1023s %1023s %1s",
+                   prog, input, output, extra);
+    if (n <= 0)
+      continue;
+    if (n != 3) {
+      fprintf(stderr, "%s:%d: expected PROG INPUT OUTPUT\n", manifest, lineno);
+      fclose(fp);
+      return 1;
     }
-    fputc('\n', stderr);
+    BatchJob job;
+    job.prog = prog;
+    job.input = input;
+    job.output = output;
+    job.ok = false;
+    jobs.push_back(job);
   }
+  fclose(fp);
 
-  fprintf(stderr, "=== STACK ===\n");
-  for (int v : st) {
-    fprintf(stderr, "%d ", v);
+  // Each program is read once however many jobs run it.
+  map<string, unique_ptr<Program> > progs;
+  for (const BatchJob& job : jobs) {
+    if (progs.count(job.prog))
+      continue;
+    if (Program* prog = Program::read(job.prog.c_str()))
+      progs[job.prog].reset(prog);
   }
-  fprintf(stderr, "\n");
-
-  fprintf(stderr, "\n");
-}
 
-void handleUnsupportedOp(char op) {
-  dump();
-  fprintf(stderr,
-          "this implementation doesn't support '%c' (%d) @%d,%d\n",
-          op, op, ix, iy);
-  exit(1);
+  atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < jobs.size();)
+      runBatchJob(opts, progs, &jobs[i]);
+  };
+  vector<thread> threads;
+  for (int i = 1; i < nthreads; i++)
+    threads.push_back(thread(worker));
+  worker();
+  for (thread& t : threads)
+    t.join();
+
+  int failed = 0;
+  for (const BatchJob& job : jobs) {
+    printf("%s %s %s: %s\n", job.prog.c_str(), job.input.c_str(),
+           job.output.c_str(), job.result.c_str());
+    failed += !job.ok;
+  }
+  return failed ? 1 : 0;
 }
 
 int main(int argc, char* argv[]) {
-  srand(time(NULL));
-
   const char* prog = argv[0];
+  const char* restore_path = NULL;
+  const char* batch_path = NULL;
+  const char* compile_path = NULL;
+  int jobs = 0;
+  bool batch = false;
+  Options opts;
+  opts.seed = time(NULL);
 
   while (argc >= 2 && argv[1][0] == '-') {
     if (!strcmp(argv[1], "-g")) {
-      debug = true;
+      opts.debug = true;
     } else if (!strcmp(argv[1], "-v")) {
-      verbose = true;
+      opts.verbose = true;
+    } else if (!strcmp(argv[1], "-i")) {
+      opts.trace = false;
+    } else if (!strcmp(argv[1], "-j")) {
+      opts.jit = true;
+    } else if (!strcmp(argv[1], "-d")) {
+      opts.dispatch = false;
+    } else if (!strcmp(argv[1], "-b")) {
+      batch = true;
+    } else if (!strcmp(argv[1], "--steps")) {
+      opts.count_steps = true;
+    } else if (!strncmp(argv[1], "--profile=", 10)) {
+      opts.profile_path = argv[1] + 10;
+    } else if (!strncmp(argv[1], "--stats=", 8)) {
+      opts.stats_path = argv[1] + 8;
+    } else if (!strncmp(argv[1], "--dump=", 7)) {
+      opts.dump_parts = argv[1] + 7;
+      if (!Befunge::validDumpParts(opts.dump_parts)) {
+        fprintf(stderr, "unknown dump part in %s\n", argv[1]);
+        return 1;
+      }
+    } else if (!strncmp(argv[1], "--core=", 7)) {
+      opts.core_path = argv[1] + 7;
+    } else if (!strncmp(argv[1], "--checkpoint=", 13)) {
+      opts.checkpoint_path = argv[1] + 13;
+    } else if (!strncmp(argv[1], "--restore=", 10)) {
+      restore_path = argv[1] + 10;
+    } else if (!strncmp(argv[1], "--compile=", 10)) {
+      compile_path = argv[1] + 10;
+    } else if (!strncmp(argv[1], "--batch=", 8)) {
+      batch_path = argv[1] + 8;
+    } else if (!strncmp(argv[1], "--jobs=", 7)) {
+      jobs = atoi(argv[1] + 7);
+    } else if (!strncmp(argv[1], "--timeout=", 10)) {
+      opts.timeout = atof(argv[1] + 10);
     } else {
       fprintf(stderr, "unknown switch %s\n", argv[1]);
       return 1;
@@ -130,267 +220,65 @@ int main(int argc, char* argv[]) {
     argv++;
   }
 
-  if (argc < 2) {
-    fprintf(stderr, "%s <src.bef>\n", prog);
-    exit(1);
-  }
-
-  FILE* fp = fopen(argv[1], "rb");
-  if (!fp) {
-    fprintf(stderr, "failed to open: %s\n", argv[1]);
-    exit(1);
-  }
-  char* buf = NULL;
-  size_t buf_len;
-  ssize_t len;
-  while ((len = getline(&buf, &buf_len, fp)) >= 0) {
-    if (buf[len-1] == '\n') {
-      buf[len-1] = '\0';
-    }
-    code.push_back(vector<int>());
-    for (char* p = buf; *p; p++) {
-      code.back().push_back(*p);
+  if (batch_path) {
+    if (opts.debug || opts.verbose || opts.count_steps || opts.profile_path ||
+        opts.stats_path || opts.checkpoint_path || opts.core_path ||
+        restore_path) {
+      fprintf(stderr, "--batch runs programs only as they are\n");
+      return 1;
     }
+    if (jobs <= 0)
+      jobs = max(1u, thread::hardware_concurrency());
+    return runBatch(batch_path, opts, jobs);
   }
-  fclose(fp);
-
-#if 0
-  signal(SIGINT, &handleSignal);
-  signal(SIGSEGV, &handleSignal);
-#endif
-
-  ix = iy = 0;
-  vx = 1;
-  vy = 0;
-  for (;;) {
-    int op = code[iy][ix];
-    //fprintf(stderr, "op=%c\n", op);
-    switch (op) {
-    case '<':
-      vx = -1;
-      vy = 0;
-      break;
-    case '>':
-      vx = 1;
-      vy = 0;
-      break;
-    case '^':
-      vx = 0;
-      vy = -1;
-      break;
-    case 'v':
-      vx = 0;
-      vy = 1;
-      break;
-
-    case '_':
-      vy = 0;
-      if (pop()) {
-        vx = -1;
-      } else {
-        vx = 1;
-      }
-      break;
-    case '|':
-      vx = 0;
-      if (pop()) {
-        vy = -1;
-      } else {
-        vy = 1;
-      }
-      break;
 
-    case '?': 
-      switch (rand() / (RAND_MAX / 4)) {
-      case 0:
-        vx = 1;
-        vy = 0;
-        break;
-      case 1:
-        vx = -1;
-        vy = 0;
-        break;
-      case 2:
-        vx = 0;
-        vy = 1;
-        break;
-      case 3:
-        vx = 0;
-        vy = -1;
-        break;
-      }
-      break;
-
-    case ' ':
-      break;
-
-    case '#':
-      step();
-      if (debug && code[iy][ix] == 'S') {
-        dump();
-      } else if (verbose && code[iy][ix] == 'V') {
-        dump();
-      }
-      break;
-
-    case '@': {
-      if (debug) {
-        fprintf(stderr, "program finished\n");
-        dump();
-      }
-      exit(0);
-    }
-
-    case '0': case '1': case '2': case '3': case '4':
-    case '5': case '6': case '7': case '8': case '9':
-      push(op - '0');
-      break;
-
-    case '"':
-      step();
-      for (;;) {
-        int c = get();
-        if (c == '"')
-          break;
-        push(c);
-        step();
-      }
-      break;
-
-    case '&': {
-      int v;
-      if (scanf("%d", &v) == 1) {
-        push(v);
-      } else {
-        if (bounce_on_fail_input) {
-          vx = -vx;
-          vy = -vy;
-        } else {
-          push(-1);
-        }
-      }
-      break;
-    }
-    case '~': {
-      int v = getchar();
-      if (v != EOF || !bounce_on_fail_input) {
-        push(v);
-      } else {
-        vx = -vx;
-        vy = -vy;
-      }
-      break;
-    }
-
-    case ',':
-      putchar(pop());
-      break;
-    case '.':
-      printf("*%d*\n", pop());
-      break;
-
-    case '+': {
-      int y = pop();
-      push(pop() + y);
-      break;
-    }
-    case '-': {
-      int y = pop();
-      push(pop() - y);
-      break;
-    }
-    case '*': {
-      int y = pop();
-      push(pop() * y);
-      break;
-    }
-    case '/': {
-      int y = pop();
-      push(pop() / y);
-      break;
-    }
-    case '%': {
-      int y = pop();
-      push(pop() % y);
-      break;
-    }
-    case '`': {
-      int y = pop();
-      push(pop() > y);
-      break;
-    }
-    case '!':
-      push(!pop());
-      break;
-
-    case ':': {
-      int v = pop();
-      push(v);
-      push(v);
-      break;
+  // The machine uses the program as long as it runs.
+  unique_ptr<Program> p;
+  Output out;
+  Input in(&out);
+  out.setTty(!batch && isatty(1));
+  in.setBatch(batch);
+  Machine m(opts, &out, &in);
+  if (restore_path) {
+    if (!m.restore(restore_path)) {
+      fprintf(stderr, "failed to restore: %s\n", restore_path);
+      exit(1);
     }
-    case '\\': {
-      int y = pop();
-      int x = pop();
-      push(y);
-      push(x);
-      break;
+  } else {
+    if (argc < 2) {
+      fprintf(stderr, "%s <src.bef>\n", prog);
+      exit(1);
     }
-    case '$':
-      pop();
-      break;
 
-    case 'g': {
-      int y = pop();
-      int x = pop();
-      int v = 0;
-      if (y >= 0 && x >= 0 && y < (int)code.size() && x < (int)code[y].size())
-        v = code[y][x];
-      //fprintf(stderr, "g x=%d y=%d v=%d\n", x, y, v);
-      push(v);
-      break;
+    p.reset(Program::read(argv[1]));
+    if (!p) {
+      fprintf(stderr, "failed to open: %s\n", argv[1]);
+      exit(1);
     }
-    case 'p': {
-      //dump();
-      int y = pop();
-      int x = pop();
-      int v = pop();
-      //fprintf(stderr, "p x=%d y=%d v=%d\n", x, y, v);
-      if (y < 0 || x < 0) {
-        dump();
-        fprintf(stderr, "negative 'p' isn't supported x=%d y=%d\n", x, y);
+    if (compile_path) {
+      if (!p->writeCompiled(compile_path)) {
+        fprintf(stderr, "failed to write: %s\n", compile_path);
         exit(1);
       }
-      if (y >= (int)code.size()) {
-        code.resize(y + 1);
-      }
-      if (x >= (int)code[y].size()) {
-        code[y].resize(x + 1);
-      }
-      code[y][x] = v;
-      break;
-    }
-
-#if 0
-    case 'S':
-      if (!debug)
-        goto unsupported;
-      dump();
-      break;
-#endif
-
-    default:
-      // We are very strict for unsupported operations.
-      handleUnsupportedOp(op);
-
+      return 0;
     }
-    step();
+    m.load(*p);
+  }
 
-    if (signaled) {
-      if (debug) {
-        dump();
-      }
-      exit(1);
-    }
+  running_machine = &m;
+  if (opts.checkpoint_path)
+    signal(SIGUSR1, &handleCheckpointSignal);
+  int status = m.run();
+  out.flush();
+  if (opts.profile_path)
+    m.writeProfile();
+  if (opts.stats_path)
+    m.writeStats();
+  if (opts.count_steps)
+    fprintf(stderr, "%llu steps\n", (unsigned long long)m.steps());
+  if (status == Machine::kTimedOut) {
+    fprintf(stderr, "timed out after %gs\n", opts.timeout);
+    return 124;
   }
+  return status;
 }
@@ -0,0 +1,203 @@
+// Standard I/O of befunge.
+//
+// ',' and '~' move one byte at a time, so going through stdio means a
+// locked call per byte. These buffer both directions in large blocks
+// instead. Before input has to block, pending output is flushed so
+// prompts show up in interactive use. In batch mode, output is only
+// written when the buffer fills up and at exit. Both default to the
+// standard file descriptors, and --batch gives each job its own files.
+// Programs embedding libbefunge can hand them callbacks instead, or run
+// a Machine on input already in memory.
+
+#ifndef BEFUNGE_IO_H_
+#define BEFUNGE_IO_H_
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+
+class Output {
+public:
+  static const int kSize = 1 << 16;
+
+  // Called with each block of output instead of writing it to a file.
+  typedef std::function<void(const char* p, size_t size)> WriteFunc;
+
+  explicit Output(int fd = 1) : fd_(fd), p_(buf_), tty_(false) {}
+  explicit Output(const WriteFunc& write)
+    : fd_(-1), write_(write), p_(buf_), tty_(false) {}
+
+  // When |tty|, lines are flushed as stdio would do for a terminal.
+  void setTty(bool tty) { tty_ = tty; }
+
+  void putChar(int c) {
+    if (__builtin_expect(p_ == buf_ + kSize, 0))
+      flush();
+    *p_++ = c;
+    if (tty_ && c == '\n')
+      flush();
+  }
+
+  // Writes |v| as '.' does.
+  void putInt(int v) {
+    char tmp[16];
+    char* e = tmp + sizeof(tmp);
+    char* q = e;
+    unsigned u = v < 0 ? 0u - v : v;
+    *--q = '\n';
+    *--q = '*';
+    do {
+      *--q = '0' + u % 10;
+      u /= 10;
+    } while (u);
+    if (v < 0)
+      *--q = '-';
+    *--q = '*';
+    if (__builtin_expect(p_ + (e - q) > buf_ + kSize, 0))
+      flush();
+    while (q != e)
+      *p_++ = *q++;
+    if (tty_)
+      flush();
+  }
+
+  void flush() {
+    if (write_) {
+      if (p_ != buf_)
+        write_(buf_, p_ - buf_);
+      p_ = buf_;
+      return;
+    }
+    const char* p = buf_;
+    while (p != p_) {
+      ssize_t r = write(fd_, p, p_ - p);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      p += r;
+    }
+    p_ = buf_;
+  }
+
+private:
+  int fd_;
+  WriteFunc write_;
+  char buf_[kSize];
+  char* p_;
+  bool tty_;
+};
+
+class Input {
+public:
+  static const int kSize = 1 << 16;
+
+  // Called to fill the buffer instead of reading a file. Returns the
+  // number of bytes stored to |p|, or 0 at the end of the input.
+  typedef std::function<ssize_t(char* p, size_t size)> ReadFunc;
+
+  // |out| is flushed before a read which may block, unless in batch mode.
+  explicit Input(Output* out, int fd = 0)
+    : fd_(fd), p_(buf_), end_(buf_), eof_(false), batch_(false), out_(out) {}
+  Input(Output* out, const ReadFunc& read)
+    : fd_(-1), read_(read), p_(buf_), end_(buf_), eof_(false), batch_(false),
+      out_(out) {}
+  // Reads the |size| bytes at |data|, which must outlive the Input,
+  // without copying them.
+  Input(const char* data, size_t size)
+    : fd_(-1), p_(data), end_(data + size), eof_(true), batch_(true),
+      out_(NULL) {}
+
+  void setBatch(bool batch) { batch_ = batch; }
+
+  // Like getchar().
+  int getChar() {
+    if (p_ == end_ && !fill())
+      return -1;
+    return (unsigned char)*p_++;
+  }
+
+  // Like scanf("%d"). Returns false if no number could be read.
+  bool getInt(int* v) {
+    int c;
+    do {
+      c = getChar();
+    } while (c == ' ' || (c >= '\t' && c <= '\r'));
+    bool neg = false;
+    if (c == '-' || c == '+') {
+      neg = c == '-';
+      c = getChar();
+    }
+    if (c < '0' || c > '9') {
+      unget(c);
+      return false;
+    }
+    unsigned u = 0;
+    do {
+      u = u * 10 + c - '0';
+      c = getChar();
+    } while (c >= '0' && c <= '9');
+    unget(c);
+    *v = neg ? 0u - u : u;
+    return true;
+  }
+
+  // Whether the input has run out.
+  bool atEof() const { return eof_ && p_ == end_; }
+
+  // The bytes read but not consumed yet, for snapshots.
+  std::string pending() const { return std::string(p_, end_); }
+
+  // Makes getChar() return |s| before reading more.
+  bool setPending(const std::string& s) {
+    if (s.size() > (size_t)kSize)
+      return false;
+    memcpy(buf_, s.data(), s.size());
+    p_ = buf_;
+    end_ = buf_ + s.size();
+    eof_ = false;
+    return true;
+  }
+
+private:
+  // Puts back the byte just read by getChar().
+  void unget(int c) {
+    if (c >= 0)
+      p_--;
+  }
+
+  bool fill() {
+    if (eof_)
+      return false;
+    if (!batch_)
+      out_->flush();
+    for (;;) {
+      ssize_t r = read_ ? read_(buf_, kSize) : read(fd_, buf_, kSize);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        eof_ = true;
+        return false;
+      }
+      p_ = buf_;
+      end_ = buf_ + r;
+      return true;
+    }
+  }
+
+  int fd_;
+  ReadFunc read_;
+  char buf_[kSize];
+  const char* p_;
+  const char* end_;
+  bool eof_;
+  bool batch_;
+  Output* out_;
+};
+
+#endif  // BEFUNGE_IO_H_
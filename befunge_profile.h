@@ -0,0 +1,257 @@
+// Execution profile of befunge (--profile=out.csv).
+//
+// Counts how many times each cell runs, how many times each op runs, and
+// the 'g' and 'p' accesses by the region of memory bc2bef lays out. Cells
+// are attributed to the nearest "*** func *** id" and "block N" labels
+// above them, which bc2bef writes into the code rows (block labels only
+// with bc2bef -g). The first columns of each function are the block
+// dispatcher, which is counted as a function of its own, "(dispatch)".
+//
+// The CSV has one row per record, with the kind in the first column:
+//
+//   kind,key,x,y,count,func,block
+//   cell,<op>,x,y,count,func,block   for each cell which ran
+//   op,<op>,,,count,,                for each op which ran
+//   get,<region>,,,count,,           for 'g' by region
+//   put,<region>,,,count,,           for 'p' by region
+
+#ifndef BEFUNGE_PROFILE_H_
+#define BEFUNGE_PROFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Profiler {
+public:
+  // The memory layout of bc2bef. An address |a| is stored at
+  // (a % 9 + 9 * type, a / 9) where type is 0 for locals, 1 for memory
+  // and 2 for phi values. Registers are in the first two rows.
+  static const int kStackPos = 9 * 9 * 9 * 9 * 8;
+  static const int kGlobalPos = 9 * 9 * 9 * 9 * 9 * 6;
+  static const int kHeapPos = 9 * 9 * 9 * 9 * 9 * 8;
+  // The code of a block starts at this column.
+  static const int kDispatchWidth = 10;
+
+  enum Region {
+    R_REG, R_CODE, R_LOCAL, R_PHI, R_LOW, R_STACK, R_GLOBAL, R_HEAP,
+    R_OTHER, NUM_REGIONS
+  };
+
+  // |lines| is the program as loaded, which is also the dense area.
+  void init(const std::vector<std::string>& lines, int width) {
+    lines_ = lines;
+    width_ = width;
+    height_ = lines.size();
+    cells_.assign((size_t)width_ * height_, 0);
+    memset(ops_, 0, sizeof(ops_));
+    memset(gets_, 0, sizeof(gets_));
+    memset(puts_, 0, sizeof(puts_));
+
+    funcs_.push_back("(setup)");
+    funcs_.push_back("(dispatch)");
+    blocks_.push_back("");
+    blocks_.push_back("");
+    block_func_.push_back(0);
+    block_func_.push_back(1);
+    int func = 0;
+    int block = 0;
+    for (const std::string& line : lines) {
+      size_t i = line.find_first_not_of(' ');
+      if (i != std::string::npos && line.compare(i, 4, "*** ") == 0) {
+        funcs_.push_back(line.substr(i + 4, line.find(" ***", i + 4) - i - 4));
+        blocks_.push_back("");
+        func = funcs_.size() - 1;
+        block = blocks_.size() - 1;
+      } else if (i != std::string::npos && i >= 10 &&
+                 line.compare(i, 6, "block ") == 0) {
+        blocks_.push_back(line.substr(i));
+        block = blocks_.size() - 1;
+      }
+      row_func_.push_back(func);
+      row_block_.push_back(block);
+      block_func_.resize(blocks_.size(), func);
+    }
+  }
+
+  void count(int x, int y, int op) {
+    if ((unsigned)x < (unsigned)width_ && (unsigned)y < (unsigned)height_)
+      cells_[(size_t)y * width_ + x]++;
+    else
+      far_cells_[std::make_pair(x, y)]++;
+    ops_[op & 255]++;
+  }
+
+  void countGet(int x, int y) {
+    gets_[regionOf(x, y, height_)]++;
+  }
+
+  void countPut(int x, int y) {
+    puts_[regionOf(x, y, height_)]++;
+  }
+
+  // Writes the CSV to |path| and the summary to stderr.
+  void report(const char* path) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+      fprintf(stderr, "failed to open: %s\n", path);
+      return;
+    }
+
+    std::vector<uint64_t> func_steps(funcs_.size());
+    std::vector<uint64_t> block_steps(blocks_.size());
+    uint64_t total = 0;
+    fprintf(fp, "kind,key,x,y,count,func,block\n");
+    for (int y = 0; y < height_; y++) {
+      for (int x = 0; x < width_; x++) {
+        uint64_t n = cells_[(size_t)y * width_ + x];
+        if (!n)
+          continue;
+        int func = row_func_[y];
+        int block = row_block_[y];
+        if (func > 1 && x < kDispatchWidth) {
+          func = 1;
+          block = 1;
+        }
+        func_steps[func] += n;
+        block_steps[block] += n;
+        total += n;
+        // The op as it was loaded. 'p' may have changed it since.
+        fprintf(fp, "cell,%s,%d,%d,%llu,%s,%s\n",
+                quote(opName(x, y)).c_str(), x, y, (unsigned long long)n,
+                quote(funcs_[func]).c_str(), quote(blocks_[block]).c_str());
+      }
+    }
+    for (auto& p : far_cells_) {
+      total += p.second;
+      fprintf(fp, "cell,,%d,%d,%llu,,\n",
+              p.first.first, p.first.second, (unsigned long long)p.second);
+    }
+    for (int op = 0; op < 256; op++) {
+      if (ops_[op]) {
+        fprintf(fp, "op,%s,,,%llu,,\n",
+                quote(std::string(1, op)).c_str(),
+                (unsigned long long)ops_[op]);
+      }
+    }
+    for (int r = 0; r < NUM_REGIONS; r++) {
+      fprintf(fp, "get,%s,,,%llu,,\n",
+              regionName(r), (unsigned long long)gets_[r]);
+    }
+    for (int r = 0; r < NUM_REGIONS; r++) {
+      fprintf(fp, "put,%s,,,%llu,,\n",
+              regionName(r), (unsigned long long)puts_[r]);
+    }
+    fclose(fp);
+
+    fprintf(stderr, "=== PROFILE === %llu steps\n", (unsigned long long)total);
+    fprintf(stderr, "--- functions ---\n");
+    std::vector<std::string> names(funcs_);
+    printTop(func_steps, names, total);
+    fprintf(stderr, "--- blocks ---\n");
+    names.clear();
+    for (size_t i = 0; i < blocks_.size(); i++) {
+      names.push_back(funcs_[block_func_[i]] +
+                      (blocks_[i].empty() ? "" : " " + blocks_[i]));
+    }
+    printTop(block_steps, names, total);
+    fprintf(stderr, "--- g/p ---\n");
+    for (int r = 0; r < NUM_REGIONS; r++) {
+      if (gets_[r] || puts_[r]) {
+        fprintf(stderr, "%-8s %12llu %12llu\n", regionName(r),
+                (unsigned long long)gets_[r], (unsigned long long)puts_[r]);
+      }
+    }
+  }
+
+  // The region of (|x|, |y|) when the code takes |height| rows.
+  static Region regionOf(int x, int y, int height) {
+    if (y < 0 || x < 0)
+      return R_OTHER;
+    if (y < 2)
+      return R_REG;
+    if (y < height)
+      return R_CODE;
+    if (x >= 27)
+      return R_OTHER;
+    if (x < 9)
+      return R_LOCAL;
+    if (x >= 18)
+      return R_PHI;
+    int64_t a = (int64_t)y * 9 + x - 9;
+    if (a < kStackPos)
+      return R_LOW;
+    if (a < kGlobalPos)
+      return R_STACK;
+    if (a < kHeapPos)
+      return R_GLOBAL;
+    return R_HEAP;
+  }
+
+  static const char* regionName(int r) {
+    static const char* const kNames[NUM_REGIONS] = {
+      "reg", "code", "local", "phi", "low", "stack", "global", "heap", "other",
+    };
+    return kNames[r];
+  }
+
+private:
+  std::string opName(int x, int y) const {
+    const std::string& line = lines_[y];
+    return std::string(1, x < (int)line.size() ? line[x] : ' ');
+  }
+
+  static std::string quote(const std::string& s) {
+    if (s.find_first_of(",\"\n") == std::string::npos)
+      return s;
+    std::string r = "\"";
+    for (char c : s) {
+      if (c == '"')
+        r += '"';
+      r += c;
+    }
+    return r + "\"";
+  }
+
+  static void printTop(const std::vector<uint64_t>& steps,
+                       const std::vector<std::string>& names,
+                       uint64_t total) {
+    std::vector<std::pair<uint64_t, size_t> > order;
+    for (size_t i = 0; i < steps.size(); i++) {
+      if (steps[i])
+        order.push_back(std::make_pair(steps[i], i));
+    }
+    std::sort(order.rbegin(), order.rend());
+    if (order.size() > 20)
+      order.resize(20);
+    for (auto& p : order) {
+      fprintf(stderr, "%12llu %5.1f%% %s\n", (unsigned long long)p.first,
+              total ? p.first * 100.0 / total : 0.0,
+              names[p.second].c_str());
+    }
+  }
+
+  std::vector<std::string> lines_;
+  int width_;
+  int height_;
+  std::vector<uint64_t> cells_;
+  std::map<std::pair<int, int>, uint64_t> far_cells_;
+  uint64_t ops_[256];
+  uint64_t gets_[NUM_REGIONS];
+  uint64_t puts_[NUM_REGIONS];
+
+  std::vector<std::string> funcs_;
+  std::vector<std::string> blocks_;
+  // The function each block is in.
+  std::vector<int> block_func_;
+  std::vector<int> row_func_;
+  std::vector<int> row_block_;
+};
+
+#endif  // BEFUNGE_PROFILE_H_
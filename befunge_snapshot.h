@@ -0,0 +1,141 @@
+// Snapshots of a running befunge (--checkpoint and --restore).
+//
+// A snapshot is "BEFSNAP1" followed by integers as LEB128 varints, signed
+// ones zigzag-encoded. Arrays of cells are written as runs of (count,
+// value), since most of the Befunge space is spaces or zeros.
+
+#ifndef BEFUNGE_SNAPSHOT_H_
+#define BEFUNGE_SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+static const char kSnapshotMagic[] = "BEFSNAP1";
+
+class SnapshotWriter {
+public:
+  SnapshotWriter() : buf_(kSnapshotMagic, kSnapshotMagic + 8) {}
+
+  void putUint(uint64_t v) {
+    while (v >= 0x80) {
+      buf_.push_back(v | 0x80);
+      v >>= 7;
+    }
+    buf_.push_back(v);
+  }
+
+  void putInt(int64_t v) {
+    putUint((uint64_t)v << 1 ^ (uint64_t)(v >> 63));
+  }
+
+  void putBytes(const std::string& s) {
+    putUint(s.size());
+    buf_.insert(buf_.end(), s.begin(), s.end());
+  }
+
+  void putRuns(const int* v, size_t n) {
+    for (size_t i = 0; i < n;) {
+      size_t j = i + 1;
+      while (j < n && v[j] == v[i])
+        j++;
+      putUint(j - i);
+      putInt(v[i]);
+      i = j;
+    }
+  }
+
+  // Writes to a temporary file first so a crash never leaves a broken
+  // snapshot behind.
+  bool writeTo(const char* path) const {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+      return false;
+    bool ok = fwrite(buf_.data(), 1, buf_.size(), fp) == buf_.size();
+    ok &= fclose(fp) == 0;
+    return ok && rename(tmp.c_str(), path) == 0;
+  }
+
+private:
+  std::vector<unsigned char> buf_;
+};
+
+// Reading past the end or a malformed varint makes ok() false, after which
+// everything reads as 0.
+class SnapshotReader {
+public:
+  SnapshotReader() : p_(NULL), end_(NULL), ok_(false) {}
+
+  bool readFrom(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+      return false;
+    char tmp[1 << 16];
+    size_t n;
+    while ((n = fread(tmp, 1, sizeof(tmp), fp)) > 0)
+      buf_.insert(buf_.end(), tmp, tmp + n);
+    fclose(fp);
+    ok_ = (buf_.size() >= 8 && !memcmp(buf_.data(), kSnapshotMagic, 8));
+    p_ = buf_.data() + 8;
+    end_ = buf_.data() + buf_.size();
+    return ok_;
+  }
+
+  bool ok() const { return ok_; }
+
+  uint64_t getUint() {
+    uint64_t v = 0;
+    for (int shift = 0; ok_; shift += 7) {
+      if (p_ == end_ || shift > 63) {
+        ok_ = false;
+        break;
+      }
+      unsigned char b = *p_++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+    return 0;
+  }
+
+  int64_t getInt() {
+    uint64_t v = getUint();
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  }
+
+  std::string getBytes() {
+    uint64_t n = getUint();
+    if (n > (uint64_t)(end_ - p_)) {
+      ok_ = false;
+      return std::string();
+    }
+    std::string s((const char*)p_, n);
+    p_ += n;
+    return s;
+  }
+
+  void getRuns(int* v, size_t n) {
+    for (size_t i = 0; i < n && ok_;) {
+      uint64_t len = getUint();
+      int x = getInt();
+      if (len == 0 || len > n - i) {
+        ok_ = false;
+        break;
+      }
+      for (uint64_t j = 0; j < len; j++)
+        v[i++] = x;
+    }
+  }
+
+private:
+  std::vector<unsigned char> buf_;
+  const unsigned char* p_;
+  const unsigned char* end_;
+  bool ok_;
+};
+
+#endif  // BEFUNGE_SNAPSHOT_H_
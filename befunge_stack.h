@@ -0,0 +1,136 @@
+// The operand stack of befunge.
+//
+// Befunge pops 0 from an empty stack. Rather than checking for that on
+// every pop, the buffer has a zero-filled guard region below its base:
+// pop() reads the value below the stack pointer, which is a guard cell
+// when the stack is empty, and then moves the stack pointer down unless
+// it is already at the base, which compiles to a conditional subtract.
+// push() only checks the high-water mark, and growing is a cold path.
+//
+// Hot loops can keep the top of the stack in a register with TosCache,
+// which also needs no branch for underflow (see below).
+
+#ifndef BEFUNGE_STACK_H_
+#define BEFUNGE_STACK_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+class Stack {
+public:
+  // pop() of an empty stack reads base[-1], and TosCache reads base[-2].
+  static const int kGuard = 2;
+
+  Stack() : buf_(NULL), base_(NULL), sp_(NULL), limit_(NULL) {
+    realloc(1024);
+  }
+
+  ~Stack() {
+    free(buf_);
+  }
+
+  void push(int v) {
+    if (__builtin_expect(sp_ == limit_, 0))
+      grow(1);
+    *sp_++ = v;
+  }
+
+  int pop() {
+    int v = sp_[-1];
+    sp_ -= sp_ != base_;
+    return v;
+  }
+
+  // Like pop() without popping.
+  int top() const { return sp_[-1]; }
+
+  size_t size() const { return sp_ - base_; }
+  size_t capacity() const { return limit_ - base_; }
+  int operator[](size_t i) const { return base_[i]; }
+
+  // For loops which keep the stack pointer in a register. Values below
+  // base() are always 0.
+  int* base() const { return base_; }
+  int* sp() const { return sp_; }
+  void setSp(int* sp) { sp_ = sp; }
+
+  // Makes room for |n| more values. This may move the stack.
+  void reserve(size_t n) {
+    if ((size_t)(limit_ - sp_) < n)
+      grow(n);
+  }
+
+private:
+  __attribute__((noinline)) void grow(size_t n) {
+    size_t cap = capacity() * 2;
+    if (cap < size() + n)
+      cap = size() + n;
+    realloc(cap);
+  }
+
+  void realloc(size_t cap) {
+    size_t size = sp_ - base_;
+    int* buf = (int*)calloc(kGuard + cap, sizeof(int));
+    if (!buf)
+      abort();
+    if (buf_)
+      memcpy(buf + kGuard, base_, size * sizeof(int));
+    free(buf_);
+    buf_ = buf;
+    base_ = buf + kGuard;
+    sp_ = base_ + size;
+    limit_ = base_ + cap;
+  }
+
+  Stack(const Stack&);
+  void operator=(const Stack&);
+
+  int* buf_;
+  int* base_;
+  int* sp_;
+  int* limit_;
+};
+
+// Keeps the top of |st| in |tos|, with |sp| pointing to the slot which
+// holds it in memory once flushed. When the stack is empty, |tos| is 0 and
+// |sp| is base() - 1, so popping reads 0 from the guard region and clamps
+// |sp| there, and pushing onto an empty stack stores that 0 back to the
+// guard region. The caller must reserve() room for what it pushes, and
+// flush() before anything else looks at |st|.
+struct TosCache {
+  explicit TosCache(Stack* st)
+    : st(st), bottom(st->base() - 1), sp(st->sp() - 1), tos(*sp) {
+  }
+
+  void push(int v) {
+    *sp++ = tos;
+    tos = v;
+  }
+
+  int pop() {
+    int v = tos;
+    tos = sp[-1];
+    sp -= sp != bottom;
+    return v;
+  }
+
+  // The top for an op to replace in place. On an empty stack, this is a
+  // 0 which is pushed, as the op pushes its result anyway.
+  int& top() {
+    sp += sp == bottom;
+    return tos;
+  }
+
+  void flush() {
+    *sp = tos;
+    st->setSp(sp + 1);
+  }
+
+  Stack* st;
+  int* bottom;
+  int* sp;
+  int tos;
+};
+
+#endif  // BEFUNGE_STACK_H_
@@ -0,0 +1,108 @@
+// Live counters of a running befunge (--stats=FILE).
+//
+// The machine rewrites the file about once a second, at the points where
+// it looks at the clock, and once more when it ends, so the progress of a
+// long run can be watched without stopping it. The file is replaced
+// atomically and has a "name value" line per counter:
+//
+//   steps N            cells run so far, counting each trace as a whole
+//   steps_per_sec N    since the previous update
+//   stack N            values on the stack now
+//   stack_max N        the most seen at an update
+//   stack_capacity N   what the stack has grown to, at least the most it
+//                      ever held
+//   rows N             rows of the Befunge space
+//   cells N            cells allocated for it
+//   get.<region> N     'g' by the region of memory bc2bef lays out
+//   put.<region> N     'p' likewise
+//
+// The regions are the ones of --profile.
+
+#ifndef BEFUNGE_STATS_H_
+#define BEFUNGE_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "befunge_profile.h"
+
+class Stats {
+public:
+  // Seconds between updates.
+  static constexpr double kInterval = 1.0;
+
+  Stats()
+    : path_(NULL), height_(0), next_(0), last_time_(0), last_steps_(0),
+      stack_max_(0) {
+    memset(gets_, 0, sizeof(gets_));
+    memset(puts_, 0, sizeof(puts_));
+  }
+
+  // The code takes |height| rows, and the run starts at |now|.
+  void init(const char* path, int height, double now) {
+    path_ = path;
+    height_ = height;
+    next_ = now + kInterval;
+    last_time_ = now;
+  }
+
+  void countGet(int x, int y) {
+    gets_[Profiler::regionOf(x, y, height_)]++;
+  }
+
+  void countPut(int x, int y) {
+    puts_[Profiler::regionOf(x, y, height_)]++;
+  }
+
+  // Whether the file is due for an update at |now|.
+  bool due(double now) const { return now >= next_; }
+
+  // Rewrites the file. Returns false if it can't be written.
+  bool update(double now, uint64_t steps, size_t stack, size_t capacity,
+              int rows, uint64_t cells) {
+    if (stack > stack_max_)
+      stack_max_ = stack;
+    double rate = now > last_time_ ? (steps - last_steps_) / (now - last_time_)
+                                   : 0;
+    last_time_ = now;
+    last_steps_ = steps;
+    next_ = now + kInterval;
+
+    std::string tmp = std::string(path_) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+      return false;
+    fprintf(fp, "steps %llu\n", (unsigned long long)steps);
+    fprintf(fp, "steps_per_sec %.0f\n", rate);
+    fprintf(fp, "stack %zu\n", stack);
+    fprintf(fp, "stack_max %zu\n", stack_max_);
+    fprintf(fp, "stack_capacity %zu\n", capacity);
+    fprintf(fp, "rows %d\n", rows);
+    fprintf(fp, "cells %llu\n", (unsigned long long)cells);
+    for (int r = 0; r < Profiler::NUM_REGIONS; r++) {
+      fprintf(fp, "get.%s %llu\n", Profiler::regionName(r),
+              (unsigned long long)gets_[r]);
+    }
+    for (int r = 0; r < Profiler::NUM_REGIONS; r++) {
+      fprintf(fp, "put.%s %llu\n", Profiler::regionName(r),
+              (unsigned long long)puts_[r]);
+    }
+    bool ok = fclose(fp) == 0;
+    return ok && rename(tmp.c_str(), path_) == 0;
+  }
+
+private:
+  const char* path_;
+  int height_;
+  double next_;
+  double last_time_;
+  uint64_t last_steps_;
+  size_t stack_max_;
+  uint64_t gets_[Profiler::NUM_REGIONS];
+  uint64_t puts_[Profiler::NUM_REGIONS];
+};
+
+#endif  // BEFUNGE_STATS_H_
@@ -0,0 +1,169 @@
+#!/usr/bin/env ruby
+#
+# Runs a fixed set of Lisp workloads against the Lisp implementations and
+# reports wall time, Befunge steps and peak RSS, as a table on stdout and
+# as JSON to compare across commits.
+#
+#   $ ruby bench/lisp_bench.rb [-o out.json] [-t timeout] [-n runs]
+#                              [-w workload,...] [-i impl,...]
+#
+# Steps are counted by a separate run of befunge --steps, which steps
+# through every cell, so they are the same in every mode. Wall time is the
+# best of -n runs. Implementations which aren't built are skipped.
+
+require 'fiddle'
+require 'json'
+require 'optparse'
+require 'tempfile'
+
+Dir.chdir(File.join(File.dirname(__FILE__), '..'))
+require './evalify'
+
+IMPLS = [
+  ['lisp', ['./lisp']],
+  ['beflisp', ['./befunge', 'beflisp.bef']],
+  ['beflisp-j', ['./befunge', '-j', 'beflisp.bef']],
+  ['purelisp', ['ruby', 'purelisp.rb']],
+]
+
+# Only run when given to -i. These compare the interpreter loops of
+# befunge without the trace cache (make dispatch_bench).
+EXTRA_IMPLS = [
+  ['beflisp-i', ['./befunge', '-i', 'beflisp.bef']],
+  ['beflisp-i-switch', ['./bench/befunge_switch', '-i', 'beflisp.bef']],
+]
+
+STEPS_COMMAND = ['./befunge', '--steps', 'beflisp.bef']
+
+FACT = '(defun fact (n) (if (eq n 0) 1 (* n (fact (- n 1)))))'
+FIB = '(defun fib (n) (if (eq n 1) 1 (if (eq n 0) 1 ' +
+  '(+ (fib (- n 1)) (fib (- n 2))))))'
+
+# The definitions of sort.l without its example.
+def sortOf(n)
+  defs = File.read('sort.l').sub(/\n\n.*/m, "\n")
+  list = (1..n).map {|i| i * 37 % 101 - 50 }
+  defs + "(sort (quote (#{list * ' '})))\n"
+end
+
+WORKLOADS = [
+  ['fact10', "#{FACT}\n(fact 10)\n"],
+  ['fib8', "#{FIB}\n(fib 8)\n"],
+  ['fizzbuzz', File.read('fizzbuzz.l')],
+  ['sort8', sortOf(8)],
+  ['sort16', sortOf(16)],
+  ['sort32', sortOf(32)],
+  ['eval-fact4', File.read('eval.l').sub(/; TEST.*/m, '') +
+   "(eval (quote #{FACT}))\n(eval (quote (fact 4)))\n"],
+  ['evalify-fizzbuzz', evalify(File.read('fizzbuzz.l'))],
+]
+
+LIBC = Fiddle.dlopen(nil)
+WAIT4 = Fiddle::Function.new(LIBC['wait4'],
+                             [Fiddle::TYPE_INT, Fiddle::TYPE_VOIDP,
+                              Fiddle::TYPE_INT, Fiddle::TYPE_VOIDP],
+                             Fiddle::TYPE_INT)
+# ru_maxrss follows ru_utime and ru_stime in struct rusage.
+RU_MAXRSS_OFFSET = 32
+RUSAGE_SIZE = 144
+
+# Runs |cmd| with |input| and returns [status, wall, max RSS in KB,
+# stdout, stderr]. The status is nil if it timed out.
+def measure(cmd, input, timeout)
+  Tempfile.create('bench_in') do |inp|
+    inp.write(input)
+    inp.flush
+    Tempfile.create('bench_out') do |out|
+      Tempfile.create('bench_err') do |err|
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        pid = Process.spawn(*cmd, in: inp.path, out: out.path, err: err.path)
+        timed_out = false
+        killer = Thread.new do
+          sleep timeout
+          timed_out = true
+          Process.kill(:KILL, pid) rescue nil
+        end
+        status = Fiddle::Pointer.malloc(4)
+        rusage = Fiddle::Pointer.malloc(RUSAGE_SIZE)
+        while WAIT4.call(pid, status, 0, rusage) < 0
+        end
+        wall = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+        killer.kill
+        st = status[0, 4].unpack1('l')
+        code = st & 0x7f == 0 ? st >> 8 & 0xff : 128 + (st & 0x7f)
+        rss = rusage[RU_MAXRSS_OFFSET, 8].unpack1('q')
+        return [timed_out ? nil : code, wall, rss,
+                File.read(out.path), File.read(err.path)]
+      end
+    end
+  end
+end
+
+out_path = 'bench.json'
+timeout = 600
+runs = 1
+workloads = WORKLOADS.map(&:first)
+impls = IMPLS.map(&:first)
+OptionParser.new do |opt|
+  opt.on('-o PATH', 'JSON output') {|v| out_path = v }
+  opt.on('-t SEC', Float, 'timeout per run') {|v| timeout = v }
+  opt.on('-n RUNS', Integer, 'runs to take the best of') {|v| runs = v }
+  opt.on('-w LIST', Array, 'workloads') {|v| workloads = v }
+  opt.on('-i LIST', Array, 'implementations') {|v| impls = v }
+end.parse!
+
+commit = `git rev-parse --short HEAD 2>/dev/null`.chomp
+results = []
+printf("%-18s %-16s %10s %12s %14s %10s\n",
+       'workload', 'impl', 'wall(s)', 'steps', 'steps/s', 'rss(KB)')
+WORKLOADS.each do |name, input|
+  next if !workloads.include?(name)
+
+  steps = nil
+  if File.executable?(STEPS_COMMAND[0])
+    code, _, _, _, err = measure(STEPS_COMMAND, input, timeout)
+    steps = err[/(\d+) steps$/, 1].to_i if code
+  end
+
+  expected = nil
+  (IMPLS + EXTRA_IMPLS).each do |impl, cmd|
+    next if !impls.include?(impl)
+    next if !File.executable?(cmd[0]) && cmd[0] != 'ruby'
+
+    best = nil
+    runs.times do
+      r = measure(cmd, input, timeout)
+      best = r if !best || !r[0] || r[1] < best[1]
+      break if !r[0]
+    end
+    code, wall, rss, output = best
+    status = !code ? 'timeout' : code != 0 ? "exit=#{code}" : 'ok'
+    # Like test.rb, only the last line is compared, as what defun prints
+    # differs.
+    output = output.lines.last.to_s
+    expected ||= output if code == 0
+    status = 'mismatch' if code == 0 && output != expected
+
+    bef_steps = cmd.include?('beflisp.bef') ? steps : nil
+    rate = bef_steps && code ? (bef_steps / wall).round : nil
+    printf("%-18s %-16s %10.3f %12s %14s %10d %s\n",
+           name, impl, wall, bef_steps || '-', rate || '-', rss,
+           status == 'ok' ? '' : status)
+    results << {
+      workload: name,
+      impl: impl,
+      status: status,
+      wall: wall.round(4),
+      steps: bef_steps,
+      steps_per_sec: rate,
+      max_rss_kb: rss,
+    }
+  end
+end
+
+File.write(out_path, JSON.pretty_generate({
+  commit: commit,
+  date: Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+  results: results,
+}) + "\n")
+puts "wrote #{out_path}"
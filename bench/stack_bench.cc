@@ -0,0 +1,178 @@
+// Compares the operand stack of befunge with the std::vector one it
+// replaced on a synthetic stream of stack ops.
+//
+// The stream mimics what bc2bef output spends its time on: constant
+// pushes, dups and swaps, binary ops, and pops, with the depth mostly
+// kept small and an occasional pop of an empty stack.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include "../befunge_stack.h"
+
+using namespace std;
+
+enum Op {
+  PUSH, DUP, SWAP, ADD, MUL, POP
+};
+
+static vector<int> makeOps(size_t n) {
+  vector<int> ops;
+  srand(42);
+  int depth = 0;
+  for (size_t i = 0; i < n; i++) {
+    int op = rand() % 6;
+    // Keep the depth around a dozen, but let some pops underflow.
+    if (depth > 16 && op <= DUP)
+      op = ADD;
+    if (depth == 0 && op >= ADD && rand() % 8)
+      op = PUSH;
+    ops.push_back(op);
+    if (op <= DUP)
+      depth++;
+    else if (op >= ADD)
+      depth = depth ? depth - 1 : 0;
+  }
+  return ops;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct VectorStack {
+  void push(int v) { st.push_back(v); }
+  int pop() {
+    if (st.empty())
+      return 0;
+    int v = st.back();
+    st.pop_back();
+    return v;
+  }
+  vector<int> st;
+};
+
+template <class S>
+static int run(S* s, const vector<int>& ops) {
+  int r = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    switch (ops[i]) {
+    case PUSH:
+      s->push(i & 15);
+      break;
+    case DUP: {
+      int x = s->pop();
+      s->push(x);
+      s->push(x);
+      break;
+    }
+    case SWAP: {
+      int y = s->pop();
+      int x = s->pop();
+      s->push(y);
+      s->push(x);
+      break;
+    }
+    case ADD: {
+      int y = s->pop();
+      int x = s->pop();
+      s->push(x + y);
+      break;
+    }
+    case MUL: {
+      int y = s->pop();
+      int x = s->pop();
+      s->push(x * y);
+      break;
+    }
+    case POP:
+      r += s->pop();
+      break;
+    }
+  }
+  return r;
+}
+
+// The way runTrace uses TosCache, with room reserved up front.
+static int runCached(Stack* st, const vector<int>& ops) {
+  int r = 0;
+  st->reserve(ops.size());
+  TosCache c(st);
+  for (size_t i = 0; i < ops.size(); i++) {
+    switch (ops[i]) {
+    case PUSH:
+      c.push(i & 15);
+      break;
+    case DUP:
+      c.push(c.top());
+      break;
+    case SWAP: {
+      int y = c.pop();
+      int x = c.pop();
+      c.push(y);
+      c.push(x);
+      break;
+    }
+    case ADD: {
+      int y = c.pop();
+      c.top() += y;
+      break;
+    }
+    case MUL: {
+      int y = c.pop();
+      c.top() *= y;
+      break;
+    }
+    case POP:
+      r += c.pop();
+      break;
+    }
+  }
+  c.flush();
+  return r;
+}
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? atoi(argv[1]) : 10000000;
+  int iters = 10;
+  vector<int> ops = makeOps(n);
+
+  double start = now();
+  int r0 = 0;
+  for (int i = 0; i < iters; i++) {
+    VectorStack s;
+    r0 += run(&s, ops);
+  }
+  double t0 = now() - start;
+
+  start = now();
+  int r1 = 0;
+  for (int i = 0; i < iters; i++) {
+    Stack s;
+    r1 += run(&s, ops);
+  }
+  double t1 = now() - start;
+
+  start = now();
+  int r2 = 0;
+  for (int i = 0; i < iters; i++) {
+    Stack s;
+    r2 += runCached(&s, ops);
+  }
+  double t2 = now() - start;
+
+  if (r0 != r1 || r0 != r2) {
+    fprintf(stderr, "mismatch: %d %d %d\n", r0, r1, r2);
+    return 1;
+  }
+
+  double ops_total = (double)n * iters;
+  printf("vector:   %.2f ns/op\n", t0 / ops_total * 1e9);
+  printf("Stack:    %.2f ns/op\n", t1 / ops_total * 1e9);
+  printf("TosCache: %.2f ns/op\n", t2 / ops_total * 1e9);
+}
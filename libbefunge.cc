@@ -0,0 +1,3472 @@
+// A Funge-98 interpretter only with Befunge-93 operations. See
+// libbefunge.h for how to use it.
+
+#include "libbefunge.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <stack>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "befunge_io.h"
+#include "befunge_profile.h"
+#include "befunge_snapshot.h"
+#include "befunge_stack.h"
+#include "befunge_stats.h"
+
+using namespace std;
+
+namespace Befunge {
+
+// Without the trace cache, the interpreter threads its ops through tables
+// of label addresses where the compiler has them. -DBEFUNGE_SWITCH builds
+// only the portable switch loop.
+#if defined(__GNUC__) && !defined(BEFUNGE_SWITCH)
+#define BEFUNGE_THREADED 1
+#else
+#define BEFUNGE_THREADED 0
+#endif
+
+// An array of the loaded program in a Grid. It has memory of its own,
+// points into a .befc file the grid mapped, or is shared with the grid of
+// a Program until the first write through it.
+template <typename T>
+class Cells {
+public:
+  Cells() : p_(NULL), size_(0), shared_(false) {}
+
+  void assign(size_t n, T v) {
+    own_.assign(n, v);
+    p_ = own_.data();
+    size_ = n;
+    shared_ = false;
+  }
+
+  void point(T* p, size_t n) {
+    vector<T>().swap(own_);
+    p_ = p;
+    size_ = n;
+    shared_ = false;
+  }
+
+  void share(const Cells& c) {
+    vector<T>().swap(own_);
+    p_ = c.p_;
+    size_ = c.size_;
+    shared_ = true;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return !size_; }
+  const T* data() const { return p_; }
+  const T& operator[](size_t i) const { return p_[i]; }
+
+  T& operator[](size_t i) {
+    if (__builtin_expect(shared_, 0)) {
+      own_.assign(p_, p_ + size_);
+      p_ = own_.data();
+      shared_ = false;
+    }
+    return p_[i];
+  }
+
+private:
+  vector<T> own_;
+  T* p_;
+  size_t size_;
+  bool shared_;
+};
+
+// A .befc file is this header followed by the arrays of the loaded
+// program as Grid keeps them, each starting at a multiple of 8 bytes:
+//
+//   row sizes               int x height
+//   down_, up_              unsigned char x width * height each
+//   bytes_                  char x width * height
+//   spaces_e_, spaces_w_    unsigned char x width * height each
+//   DispatchMap::rows       int x dispatchers
+//   DispatchMap::first      int x dispatchers
+//
+// so a grid can map the file instead of deriving them again. The file is
+// only for the build of befunge which wrote it, which the header records.
+// Reading it checks that and the size, and that the row sizes and the
+// dispatchers are within the program.
+struct CompiledHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  char build[24];
+  int32_t width;
+  int32_t height;
+  int32_t dispatchers;
+  uint32_t reserved;
+};
+
+static const char kCompiledMagic[] = "BEFCODE1";
+static const uint32_t kCompiledByteOrder = 0x01020304;
+// Bumped when the layout changes.
+static const uint32_t kCompiledVersion = 2;
+static const char kCompiledBuild[24] = __DATE__ " " __TIME__;
+
+// Where the dispatchers bc2bef puts in front of its blocks are in a loaded
+// program (see Dispatcher). A Program finds them once for all of its
+// machines, and its .befc file keeps them.
+struct DispatchMap {
+  DispatchMap() : known(false) {}
+
+  bool known;
+  // The top row of each dispatcher.
+  vector<int> rows;
+  // The first dispatcher of the chain each one is in.
+  vector<int> first;
+};
+
+// The Befunge space. Each row keeps its own size since the IP wraps
+// around at the end of the row it is on. The loaded program lives in a
+// dense array, and everything else 'p' writes goes to fixed-size tiles
+// found through a hash, so memory scales with the cells actually touched
+// however far away bc2bef puts its locals, globals and heap.
+//
+// The program is text, and bc2bef only stores numbers into its register
+// rows, so the dense array keeps a byte per cell, which is what the IP
+// fetches from. A row gets a full int per cell as well once 'p' stores
+// something which doesn't fit in a byte there, and the byte of such a
+// cell is 0, which no op is, so only executing it looks at the int.
+//
+// Going up or down, the IP skips the rows too short to reach its column,
+// and the rows 'p' made between the program and bc2bef's memory are
+// mostly empty. For the columns of the loaded program, how far the next
+// row up and down which reaches the column is, is kept in a byte for each
+// cell of it. Beyond that, the longest row of each page of rows lets a
+// search skip pages.
+//
+// bc2bef indents its code and pads its blocks with spaces, so the IP going
+// sideways would spend most of its steps on them. For each cell of the
+// loaded program, the length of the run of spaces starting there is kept
+// in both directions, and the interpreters cross a run in one go.
+//
+// Program loads its source into a grid once, and each machine starts from
+// a copy of that. A program read from a .befc file has its arrays mapped
+// instead, and machines map them again privately, so only the pages they
+// touch are read and only the ones they write are copied.
+class Grid {
+public:
+  Grid()
+    : height_(0), dense_w_(0), dense_h_(0), map_(NULL), map_size_(0),
+      fd_(-1), last_key_(~0ULL), last_(NULL) {
+  }
+
+  ~Grid() {
+    for (int* w : wide_)
+      delete[] w;
+    for (auto& t : tiles_)
+      delete[] t.second;
+    for (int* p : row_pages_)
+      delete[] p;
+    if (map_)
+      munmap(map_, map_size_);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  void load(const vector<string>& lines) {
+    dense_h_ = lines.size();
+    dense_w_ = 0;
+    for (const string& l : lines)
+      dense_w_ = max<int>(dense_w_, l.size());
+    bytes_.assign((size_t)dense_w_ * dense_h_, 0);
+    wide_.assign(dense_h_, NULL);
+    for (int y = 0; y < dense_h_; y++) {
+      copy(lines[y].begin(), lines[y].end(), &bytes_[(size_t)y * dense_w_]);
+      setRowSize(y, lines[y].size());
+    }
+    height_ = dense_h_;
+    indexColumns();
+    indexSpaces();
+  }
+
+  // Starts from the program |prog| as it was loaded, which has to outlive
+  // this grid.
+  void loadFrom(const Grid& prog) {
+    dense_w_ = prog.dense_w_;
+    dense_h_ = prog.dense_h_;
+    height_ = dense_h_;
+    dispatch_map_ = prog.dispatch_map_;
+    wide_.assign(dense_h_, NULL);
+    for (int y = 0; y < dense_h_; y++)
+      setRowSize(y, prog.rowSize(y));
+    if (prog.fd_ >= 0) {
+      if (char* m = mapCompiled(prog.fd_, PROT_READ | PROT_WRITE,
+                                prog.dispatch_map_.rows.size())) {
+        pointArrays(m);
+        return;
+      }
+    }
+    bytes_.share(prog.bytes_);
+    down_.share(prog.down_);
+    up_.share(prog.up_);
+    spaces_e_.share(prog.spaces_e_);
+    spaces_w_.share(prog.spaces_w_);
+  }
+
+  // Maps the .befc file open as |fd|, which the grid closes when it is
+  // gone. Returns why it can't, or NULL.
+  const char* loadCompiled(int fd) {
+    CompiledHeader h;
+    struct stat st;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || fstat(fd, &st) ||
+        memcmp(h.magic, kCompiledMagic, 8)) {
+      return "not a .befc file";
+    }
+    if (h.byte_order != kCompiledByteOrder || h.version != kCompiledVersion ||
+        memcmp(h.build, kCompiledBuild, sizeof(h.build))) {
+      return "written by another build of befunge";
+    }
+    if (h.width < 0 || h.height < 0 || h.dispatchers < 0 ||
+        (uint64_t)h.width * h.height > (1ULL << 32) ||
+        (uint64_t)st.st_size !=
+        compiledLayout(h.width, h.height, h.dispatchers).end) {
+      return "broken .befc file";
+    }
+    dense_w_ = h.width;
+    dense_h_ = h.height;
+    height_ = dense_h_;
+    char* m = mapCompiled(fd, PROT_READ, h.dispatchers);
+    if (!m)
+      return "failed to map";
+    CompiledLayout l = compiledLayout(h.width, h.height, h.dispatchers);
+    const int* sizes = reinterpret_cast<const int*>(m + l.sizes);
+    wide_.assign(dense_h_, NULL);
+    for (int y = 0; y < dense_h_; y++) {
+      if (sizes[y] < 0 || sizes[y] > dense_w_)
+        return "broken .befc file";
+      setRowSize(y, sizes[y]);
+    }
+    const int* rows = reinterpret_cast<const int*>(m + l.dispatch_rows);
+    const int* first = reinterpret_cast<const int*>(m + l.dispatch_first);
+    dispatch_map_.rows.assign(rows, rows + h.dispatchers);
+    dispatch_map_.first.assign(first, first + h.dispatchers);
+    for (int i = 0; i < h.dispatchers; i++) {
+      if (rows[i] < (i ? rows[i - 1] + 3 : 0) || rows[i] + 3 > dense_h_ ||
+          (first[i] != i && (!i || first[i] != first[i - 1]))) {
+        return "broken .befc file";
+      }
+    }
+    dispatch_map_.known = true;
+    pointArrays(m);
+    fd_ = fd;
+    return NULL;
+  }
+
+  // Writes the program as loaded to |path| as a .befc file.
+  bool writeCompiled(const char* path) const {
+    int dispatchers = dispatch_map_.rows.size();
+    CompiledLayout l = compiledLayout(dense_w_, dense_h_, dispatchers);
+    size_t n = (size_t)dense_w_ * dense_h_;
+    vector<char> buf(l.end);
+    CompiledHeader* h = reinterpret_cast<CompiledHeader*>(buf.data());
+    memcpy(h->magic, kCompiledMagic, 8);
+    h->byte_order = kCompiledByteOrder;
+    h->version = kCompiledVersion;
+    memcpy(h->build, kCompiledBuild, sizeof(h->build));
+    h->width = dense_w_;
+    h->height = dense_h_;
+    h->dispatchers = dispatchers;
+    int* sizes = reinterpret_cast<int*>(&buf[l.sizes]);
+    for (int y = 0; y < dense_h_; y++)
+      sizes[y] = rowSize(y);
+    memcpy(&buf[l.down], down_.data(), n);
+    memcpy(&buf[l.up], up_.data(), n);
+    memcpy(&buf[l.bytes], bytes_.data(), n);
+    memcpy(&buf[l.spaces_e], spaces_e_.data(), n);
+    memcpy(&buf[l.spaces_w], spaces_w_.data(), n);
+    memcpy(&buf[l.dispatch_rows], dispatch_map_.rows.data(),
+           dispatchers * sizeof(int));
+    memcpy(&buf[l.dispatch_first], dispatch_map_.first.data(),
+           dispatchers * sizeof(int));
+
+    string tmp = string(path) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+      return false;
+    bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    ok &= fclose(fp) == 0;
+    return ok && rename(tmp.c_str(), path) == 0;
+  }
+
+  void save(SnapshotWriter* w) const {
+    w->putUint(dense_w_);
+    w->putUint(dense_h_);
+    w->putUint(height_);
+    vector<int> dense((size_t)dense_w_ * dense_h_);
+    for (int y = 0; y < dense_h_; y++) {
+      for (int x = 0; x < dense_w_; x++)
+        dense[(size_t)y * dense_w_ + x] = get(x, y);
+    }
+    w->putRuns(dense.data(), dense.size());
+    vector<int> sizes(height_);
+    for (int y = 0; y < height_; y++)
+      sizes[y] = rowSize(y);
+    w->putRuns(sizes.data(), sizes.size());
+    w->putUint(tiles_.size());
+    for (auto& t : tiles_) {
+      w->putUint(t.first);
+      w->putRuns(t.second, kTileSize * kTileSize);
+    }
+  }
+
+  // Loads what save() wrote into an empty grid. Returns false if the
+  // snapshot is broken.
+  bool restore(SnapshotReader* r) {
+    dense_w_ = r->getUint();
+    dense_h_ = r->getUint();
+    height_ = r->getUint();
+    if (!r->ok() || dense_w_ < 0 || dense_h_ < 0 || height_ < dense_h_ ||
+        (uint64_t)dense_w_ * dense_h_ > (1ULL << 32)) {
+      return false;
+    }
+    vector<int> dense((size_t)dense_w_ * dense_h_);
+    r->getRuns(dense.data(), dense.size());
+    bytes_.assign(dense.size(), 0);
+    wide_.assign(dense_h_, NULL);
+    for (int y = 0; y < dense_h_; y++) {
+      for (int x = 0; x < dense_w_; x++)
+        putDense(x, y, dense[(size_t)y * dense_w_ + x]);
+    }
+    vector<int> sizes(height_);
+    r->getRuns(sizes.data(), sizes.size());
+    for (int y = 0; y < height_; y++) {
+      if (sizes[y])
+        setRowSize(y, sizes[y]);
+    }
+    uint64_t n = r->getUint();
+    for (uint64_t i = 0; i < n && r->ok(); i++) {
+      uint64_t key = r->getUint();
+      int* t = new int[kTileSize * kTileSize]();
+      tiles_[key] = t;
+      r->getRuns(t, kTileSize * kTileSize);
+    }
+    indexColumns();
+    indexSpaces();
+    return r->ok();
+  }
+
+  int height() const { return height_; }
+
+  // Where the dispatchers are, if the grid has been told.
+  const DispatchMap& dispatchMap() const { return dispatch_map_; }
+  void setDispatchMap(const DispatchMap& map) { dispatch_map_ = map; }
+
+  // How many cells the space has memory for.
+  uint64_t cellsAllocated() const {
+    uint64_t n = (uint64_t)dense_w_ * dense_h_;
+    for (int* w : wide_)
+      n += w ? dense_w_ : 0;
+    return n + (uint64_t)tiles_.size() * kTileSize * kTileSize;
+  }
+
+  int rowSize(int y) const {
+    size_t page = (unsigned)y >> kRowPageBits;
+    if (page >= row_pages_.size() || !row_pages_[page])
+      return 0;
+    return row_pages_[page][y & (kRowPageSize - 1)];
+  }
+
+  // The row the IP moving down from (|x|, |y|) lands on. It wraps around
+  // to the top row whatever its size.
+  int nextRow(int x, int y) const {
+    if (x < 0)
+      return y + 1 < height_ ? y + 1 : 0;
+    int from = y + 1;
+    if (x < dense_w_ && y < dense_h_) {
+      int n = downRow(x, y);
+      if (n < dense_h_)
+        return n;
+      from = dense_h_;
+    }
+    int n = findRowDown(x, from, height_);
+    return n >= 0 ? n : 0;
+  }
+
+  // The row the IP moving up from (|x|, |y|) lands on. It wraps around to
+  // the bottom row whatever its size.
+  int prevRow(int x, int y) const {
+    if (x < 0)
+      return y > 0 ? y - 1 : height_ - 1;
+    int p = -1;
+    if (x < dense_w_) {
+      if (y > dense_h_) {
+        p = findRowUp(x, dense_h_, y);
+        y = dense_h_;
+      }
+      if (p < 0 && y < dense_h_)
+        p = upRow(x, y);
+      else if (p < 0 && y > 0)
+        p = rowSize(y - 1) > x ? y - 1 : upRow(x, y - 1);
+    } else {
+      p = findRowUp(x, 0, y);
+    }
+    return p >= 0 ? p : height_ - 1;
+  }
+
+  // Whether (x, y) is in the loaded program.
+  bool isDense(int x, int y) const {
+    return (unsigned)x < (unsigned)dense_w_ && (unsigned)y < (unsigned)dense_h_;
+  }
+
+  int denseWidth() const { return dense_w_; }
+  int denseHeight() const { return dense_h_; }
+
+  // Where the value of (|x|, |y|) in the loaded program is kept from now
+  // on, for the JIT to load and store directly. This widens the row, and
+  // stores have to update opCell() as well.
+  int* denseCell(int x, int y) {
+    if (!wide_[y])
+      widenRow(y);
+    return &wide_[y][x];
+  }
+
+  // The op byte of (|x|, |y|), for the JIT to store to. Since the grid
+  // doesn't see those stores, runs of spaces no longer go across the cell.
+  char* opCell(int x, int y) {
+    size_t i = (size_t)y * dense_w_ + x;
+    if (pinned_.empty())
+      pinned_.assign(bytes_.size(), false);
+    if (!pinned_[i]) {
+      pinned_[i] = true;
+      indexSpace(x, y);
+    }
+    return &bytes_[i];
+  }
+
+  // How many spaces there are from (|x|, |y|) on going east, which the IP
+  // may cross at once. Runs stop at the end of the loaded program, at
+  // cells given out by opCell(), and after 255 cells. 0 for other cells.
+  int spacesEast(int x, int y) const {
+    return isDense(x, y) ? spaces_e_[(size_t)y * dense_w_ + x] : 0;
+  }
+
+  // Same as spacesEast() going west.
+  int spacesWest(int x, int y) const {
+    return isDense(x, y) ? spaces_w_[(size_t)y * dense_w_ + x] : 0;
+  }
+
+  // What to run at (|x|, |y|). Same as get() unless the value doesn't fit
+  // in a byte, when this may be 0 instead.
+  int op(int x, int y) const {
+    if (isDense(x, y))
+      return bytes_[(size_t)y * dense_w_ + x];
+    return get(x, y);
+  }
+
+  // Returns 0 for cells which were never written, including negative ones.
+  int get(int x, int y) const {
+    if (isDense(x, y)) {
+      const int* w = wide_[y];
+      return w ? w[x] : bytes_[(size_t)y * dense_w_ + x];
+    }
+    if (x < 0 || y < 0)
+      return 0;
+    const int* t = findTile(x, y);
+    return t ? t[tileIndex(x, y)] : 0;
+  }
+
+  // The coordinates must not be negative.
+  void put(int x, int y, int v) {
+    if (isDense(x, y)) {
+      putDense(x, y, v);
+    } else {
+      int* t = findTile(x, y);
+      if (!t)
+        t = newTile(x, y);
+      t[tileIndex(x, y)] = v;
+    }
+    if (x >= rowSize(y))
+      setRowSize(y, x + 1);
+    if (y >= height_)
+      height_ = y + 1;
+  }
+
+  // Calls |f(x, y, v)| for each nonzero cell outside of the loaded
+  // program, in no particular order.
+  template <typename F>
+  void forEachSparse(F f) const {
+    for (auto& t : tiles_) {
+      int tx = (int)(uint32_t)t.first << kTileBits;
+      int ty = (int)(t.first >> 32) << kTileBits;
+      for (int i = 0; i < kTileSize * kTileSize; i++) {
+        if (int v = t.second[i])
+          f(tx + (i & (kTileSize - 1)), ty + (i >> kTileBits), v);
+      }
+    }
+  }
+
+private:
+  // Where the arrays are in a .befc file, and its size.
+  struct CompiledLayout {
+    size_t sizes, down, up, bytes, spaces_e, spaces_w;
+    size_t dispatch_rows, dispatch_first, end;
+  };
+
+  static CompiledLayout compiledLayout(int w, int h, int dispatchers) {
+    size_t n = (size_t)w * h;
+    size_t off = sizeof(CompiledHeader);
+    auto next = [&off](size_t size) {
+      size_t start = off;
+      off = (off + size + 7) & ~(size_t)7;
+      return start;
+    };
+    CompiledLayout l;
+    l.sizes = next(h * sizeof(int));
+    l.down = next(n);
+    l.up = next(n);
+    l.bytes = next(n);
+    l.spaces_e = next(n);
+    l.spaces_w = next(n);
+    l.dispatch_rows = next(dispatchers * sizeof(int));
+    l.dispatch_first = next(dispatchers * sizeof(int));
+    l.end = off;
+    return l;
+  }
+
+  // Maps the whole .befc file open as |fd| for this grid, or returns NULL.
+  char* mapCompiled(int fd, int prot, int dispatchers) {
+    map_size_ = compiledLayout(dense_w_, dense_h_, dispatchers).end;
+    void* m = mmap(NULL, map_size_, prot, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED)
+      return NULL;
+    map_ = m;
+    return static_cast<char*>(m);
+  }
+
+  // Points the arrays into the .befc file mapped at |m|.
+  void pointArrays(char* m) {
+    CompiledLayout l = compiledLayout(dense_w_, dense_h_, 0);
+    size_t n = (size_t)dense_w_ * dense_h_;
+    down_.point(reinterpret_cast<unsigned char*>(m + l.down), n);
+    up_.point(reinterpret_cast<unsigned char*>(m + l.up), n);
+    bytes_.point(m + l.bytes, n);
+    spaces_e_.point(reinterpret_cast<unsigned char*>(m + l.spaces_e), n);
+    spaces_w_.point(reinterpret_cast<unsigned char*>(m + l.spaces_w), n);
+  }
+
+  static const int kTileBits = 5;
+  static const int kTileSize = 1 << kTileBits;
+  static const int kRowPageBits = 12;
+  static const int kRowPageSize = 1 << kRowPageBits;
+
+  static uint64_t tileKey(int x, int y) {
+    return (uint64_t)(y >> kTileBits) << 32 | (uint32_t)(x >> kTileBits);
+  }
+
+  static int tileIndex(int x, int y) {
+    return (y & (kTileSize - 1)) << kTileBits | (x & (kTileSize - 1));
+  }
+
+  int* findTile(int x, int y) const {
+    uint64_t key = tileKey(x, y);
+    if (key == last_key_)
+      return last_;
+    auto found = tiles_.find(key);
+    if (found == tiles_.end())
+      return NULL;
+    last_key_ = key;
+    last_ = found->second;
+    return last_;
+  }
+
+  void putDense(int x, int y, int v) {
+    bool fits = (char)v == v;
+    if (!wide_[y] && !fits)
+      widenRow(y);
+    if (int* w = wide_[y])
+      w[x] = v;
+    char& b = bytes_[(size_t)y * dense_w_ + x];
+    bool was_space = b == ' ';
+    b = fits ? v : 0;
+    if ((b == ' ') != was_space && !spaces_e_.empty())
+      indexSpace(x, y);
+  }
+
+  void widenRow(int y) {
+    int* w = new int[dense_w_];
+    const char* b = &bytes_[(size_t)y * dense_w_];
+    for (int x = 0; x < dense_w_; x++)
+      w[x] = b[x];
+    wide_[y] = w;
+  }
+
+  int* newTile(int x, int y) {
+    int* t = new int[kTileSize * kTileSize]();
+    last_key_ = tileKey(x, y);
+    last_ = t;
+    tiles_[last_key_] = t;
+    return t;
+  }
+
+  void setRowSize(int y, int size) {
+    size_t page = (unsigned)y >> kRowPageBits;
+    if (page >= row_pages_.size()) {
+      row_pages_.resize(page + 1);
+      page_max_.resize(page + 1);
+    }
+    if (!row_pages_[page])
+      row_pages_[page] = new int[kRowPageSize]();
+    int& old = row_pages_[page][y & (kRowPageSize - 1)];
+    if (y < dense_h_ && !down_.empty()) {
+      for (int x = old; x < size && x < dense_w_; x++)
+        indexCell(x, y);
+    }
+    old = size;
+    page_max_[page] = max(page_max_[page], size);
+  }
+
+  // |down_| and |up_| keep the distances to rows up to kFarRows - 1
+  // away. kFarRows means none of those rows reaches the column, and the
+  // search goes on from the farthest of them.
+  static const int kFarRows = 255;
+
+  // The next row below |y| of the loaded program which reaches column
+  // |x|, or |dense_h_|.
+  int downRow(int x, int y) const {
+    const unsigned char* down = &down_[(size_t)x * dense_h_];
+    while (down[y] == kFarRows)
+      y += kFarRows - 1;
+    return y + down[y];
+  }
+
+  // The previous row above |y| of the loaded program which reaches column
+  // |x|, or -1.
+  int upRow(int x, int y) const {
+    const unsigned char* up = &up_[(size_t)x * dense_h_];
+    while (up[y] == kFarRows)
+      y -= kFarRows - 1;
+    return y - up[y];
+  }
+
+  // Builds |down_| and |up_| from the row sizes.
+  void indexColumns() {
+    down_.assign((size_t)dense_w_ * dense_h_, 0);
+    up_.assign((size_t)dense_w_ * dense_h_, 0);
+    vector<int> sizes(dense_h_);
+    for (int y = 0; y < dense_h_; y++)
+      sizes[y] = rowSize(y);
+    for (int x = 0; x < dense_w_; x++) {
+      unsigned char* down = &down_[(size_t)x * dense_h_];
+      unsigned char* up = &up_[(size_t)x * dense_h_];
+      int n = dense_h_;
+      for (int y = dense_h_; y--;) {
+        down[y] = min(n - y, kFarRows);
+        if (sizes[y] > x)
+          n = y;
+      }
+      int p = -1;
+      for (int y = 0; y < dense_h_; y++) {
+        up[y] = min(y - p, kFarRows);
+        if (sizes[y] > x)
+          p = y;
+      }
+    }
+  }
+
+  // Row |y| of the loaded program now reaches column |x|, so it becomes
+  // the next row of the rows up to the one above which reaches |x|, and
+  // the previous row of those down to the one below.
+  void indexCell(int x, int y) {
+    int p = upRow(x, y);
+    int n = downRow(x, y);
+    unsigned char* down = &down_[(size_t)x * dense_h_];
+    unsigned char* up = &up_[(size_t)x * dense_h_];
+    for (int i = max(p, 0); i < y; i++)
+      down[i] = min(y - i, kFarRows);
+    for (int i = y + 1; i <= n && i < dense_h_; i++)
+      up[i] = min(i - y, kFarRows);
+  }
+
+  // Builds |spaces_e_| and |spaces_w_| from the loaded program.
+  void indexSpaces() {
+    spaces_e_.assign(bytes_.size(), 0);
+    spaces_w_.assign(bytes_.size(), 0);
+    pinned_.clear();
+    for (int y = 0; y < dense_h_; y++) {
+      size_t row = (size_t)y * dense_w_;
+      const char* b = &bytes_[row];
+      for (int x = findByte(b, 0, dense_w_, true); x < dense_w_;) {
+        int end = findByte(b, x, dense_w_, false);
+        for (int i = x; i < end; i++) {
+          spaces_e_[row + i] = min(end - i, 255);
+          spaces_w_[row + i] = min(i - x + 1, 255);
+        }
+        x = findByte(b, end, dense_w_, true);
+      }
+    }
+  }
+
+  // Whether the IP may cross (|x|, |y|) of the loaded program with a run.
+  bool isRunSpace(int x, int y) const {
+    size_t i = (size_t)y * dense_w_ + x;
+    return bytes_[i] == ' ' && (pinned_.empty() || !pinned_[i]);
+  }
+
+  // (|x|, |y|) became or stopped being part of runs of spaces. Only the
+  // runs going east which end there and the ones going west which start
+  // there change, and only up to where they are cut.
+  void indexSpace(int x, int y) {
+    unsigned char* e = &spaces_e_[(size_t)y * dense_w_];
+    unsigned char* w = &spaces_w_[(size_t)y * dense_w_];
+    for (int i = x; i >= 0 && x - i < 256; i--) {
+      int next = i + 1 < dense_w_ ? e[i + 1] : 0;
+      e[i] = isRunSpace(i, y) ? min(next + 1, 255) : 0;
+      if (i < x && !e[i])
+        break;
+    }
+    for (int i = x; i < dense_w_ && i - x < 256; i++) {
+      int prev = i > 0 ? w[i - 1] : 0;
+      w[i] = isRunSpace(i, y) ? min(prev + 1, 255) : 0;
+      if (i > x && !w[i])
+        break;
+    }
+  }
+
+  // The first byte in [|from|, |to|) of |b| which is a space if |space|,
+  // or isn't otherwise, or |to|. Looks at 16 bytes at a time with SSE2.
+  static int findByte(const char* b, int from, int to, bool space) {
+    int x = from;
+#if defined(__SSE2__)
+    const __m128i spaces = _mm_set1_epi8(' ');
+    for (; x + 16 <= to; x += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+      unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, spaces));
+      if (!space)
+        m ^= 0xffff;
+      if (m)
+        return x + __builtin_ctz(m);
+    }
+#endif
+    for (; x < to; x++) {
+      if ((b[x] == ' ') == space)
+        return x;
+    }
+    return to;
+  }
+
+  // The first row in [|from|, |to|) which reaches column |x|, or -1.
+  int findRowDown(int x, int from, int to) const {
+    for (int y = from; y < to;) {
+      size_t page = (unsigned)y >> kRowPageBits;
+      if (page >= row_pages_.size())
+        break;
+      if (page_max_[page] <= x) {
+        y = (page + 1) << kRowPageBits;
+        continue;
+      }
+      if (row_pages_[page][y & (kRowPageSize - 1)] > x)
+        return y;
+      y++;
+    }
+    return -1;
+  }
+
+  // The last row in [|from|, |to|) which reaches column |x|, or -1.
+  int findRowUp(int x, int from, int to) const {
+    for (int y = to - 1; y >= from;) {
+      size_t page = (unsigned)y >> kRowPageBits;
+      if (page >= row_pages_.size()) {
+        y = (row_pages_.size() << kRowPageBits) - 1;
+        continue;
+      }
+      if (page_max_[page] <= x) {
+        y = (page << kRowPageBits) - 1;
+        continue;
+      }
+      if (row_pages_[page][y & (kRowPageSize - 1)] > x)
+        return y;
+      y--;
+    }
+    return -1;
+  }
+
+  int height_;
+  int dense_w_;
+  int dense_h_;
+  // The cells of the loaded program as ops.
+  Cells<char> bytes_;
+  // The values of each row of the loaded program which has an int per
+  // cell, or NULL.
+  vector<int*> wide_;
+  unordered_map<uint64_t, int*> tiles_;
+  vector<int*> row_pages_;
+  // The longest row in each page of |row_pages_|.
+  vector<int> page_max_;
+  // For each column of the loaded program and each row, how far the next
+  // row down which reaches the column, or |dense_h_|, and the previous row
+  // up, or -1, are (see downRow() and upRow()). Indexed by x * |dense_h_|
+  // + y.
+  Cells<unsigned char> down_;
+  Cells<unsigned char> up_;
+  // For each cell of the loaded program, the length of the run of spaces
+  // from there going east and west, indexed like |bytes_|.
+  Cells<unsigned char> spaces_e_;
+  Cells<unsigned char> spaces_w_;
+  // The cells given out by opCell(), once there are any.
+  vector<bool> pinned_;
+  DispatchMap dispatch_map_;
+  // The .befc file the arrays point into, and the file itself if this is
+  // the grid of a Program.
+  void* map_;
+  size_t map_size_;
+  int fd_;
+  mutable uint64_t last_key_;
+  mutable int* last_;
+};
+
+// bc2bef puts a dispatcher in front of each block, which walks through the
+// blocks one at a time until the relative block id on the stack is 0:
+//
+//   >:#v_ >$  <code of the block>
+//   v-1<>  1+^
+//   v   ^_^#:<
+//
+// Going forward, the IP comes down column 0 to the '>' at the top left and
+// decrements the id for each block it passes. Going back, it comes to the
+// '<' at the bottom right, increments the id, and goes up column 9 to the
+// previous dispatcher. Both pop the id once at the block. A Program finds
+// the dispatchers when it is loaded, so the IP can jump to the block in
+// one go.
+class Dispatcher {
+public:
+  static const int kWidth = 10;
+
+  Dispatcher() : enabled_(false) {}
+
+  // Finds the dispatchers of |code| into |map|.
+  static void find(const Grid& code, DispatchMap* map) {
+    static const char* const kRows[3] = {
+      ">:#v_ >$  ", "v-1<>  1+^", "v   ^_^#:<",
+    };
+    vector<int>& rows = map->rows;
+    vector<int>& first = map->first;
+    rows.clear();
+    first.clear();
+    int height = code.denseHeight();
+    for (int y = 0; y + 2 < height; y++) {
+      bool ok = true;
+      for (int i = 0; i < 3; i++)
+        ok &= rowStartsWith(code, y + i, kRows[i]);
+      if (!ok)
+        continue;
+
+      // The dispatchers are chained if the IP keeps going down column 0
+      // and up column 9 between them. Blocks which take more rows have
+      // 'v' and '^' there.
+      bool chained = !rows.empty();
+      for (int y2 = rows.empty() ? y : rows.back() + 3; y2 < y; y2++) {
+        int size = code.rowSize(y2);
+        int left = code.op(0, y2);
+        int right = code.op(kWidth - 1, y2);
+        if ((size > 0 && left != ' ' && left != 'v') ||
+            (size > kWidth - 1 && right != ' ' && right != '^')) {
+          chained = false;
+        }
+      }
+      first.push_back(chained ? first.back() : rows.size());
+      rows.push_back(y);
+      y += 2;
+    }
+    map->known = true;
+  }
+
+  // Takes the dispatchers of |code| from its map, or finds them if it has
+  // none, as after a restore.
+  void init(const Grid& code) {
+    const DispatchMap* map = &code.dispatchMap();
+    DispatchMap found;
+    if (!map->known) {
+      find(code, &found);
+      map = &found;
+    }
+    rows_ = map->rows;
+    first_ = map->first;
+    top_.assign(code.denseHeight(), -1);
+    for (size_t i = 0; i < rows_.size(); i++)
+      top_[rows_[i]] = i;
+    last_.resize(rows_.size());
+    for (size_t i = rows_.size(); i--;) {
+      last_[i] = (i + 1 < rows_.size() && first_[i + 1] == first_[i] ?
+                  last_[i + 1] : i);
+    }
+    jit_entries_.assign(rows_.size(), NULL);
+    enabled_ = !rows_.empty();
+  }
+
+  // The rows which the dispatchers and the columns between them take.
+  int beginRow() const { return rows_.empty() ? 0 : rows_.front(); }
+  int endRow() const { return rows_.empty() ? 0 : rows_.back() + 3; }
+
+  bool isEntry(int x, int y) const {
+    if (!enabled_ || (unsigned)y >= top_.size())
+      return false;
+    if (x == 0)
+      return top_[y] >= 0;
+    return x == kWidth - 1 && y >= 2 && top_[y - 2] >= 0;
+  }
+
+  // From the entry at (|x|, |y|), an id |k| reaches the dispatcher
+  // |base| + |k| + |bias| if |k| + |bias| is within [0, |range|].
+  void reach(int x, int y, int* bias, int* range, int* base) const {
+    if (x == 0) {
+      int g = top_[y];
+      *bias = 0;
+      *range = last_[g] - g;
+      *base = g;
+    } else {
+      int g = top_[y - 2];
+      *bias = g - first_[g];
+      *range = *bias;
+      *base = first_[g];
+    }
+  }
+
+  // If the IP at (|x|, |y|) is at the entry of a dispatcher and the block
+  // it would reach is known, pops the id off |st| and moves the IP to the
+  // '$' before the block.
+  bool jump(int* x, int* y, int* dx, int* dy, Stack* st) const {
+    if (!isEntry(*x, *y))
+      return false;
+    int bias, range, base;
+    reach(*x, *y, &bias, &range, &base);
+    unsigned u = (unsigned)st->top() + bias;
+    if (u > (unsigned)range)
+      return false;
+    st->pop();
+    *x = 7;
+    *y = rows_[base + u];
+    *dx = 1;
+    *dy = 0;
+    return true;
+  }
+
+  // The dispatcher whose block a trace starting at (|x|, |y|) going
+  // right runs, or -1. The IP steps there after jump().
+  int blockAt(int x, int y) const {
+    if (!enabled_ || x != 8 || (unsigned)y >= top_.size())
+      return -1;
+    return top_[y];
+  }
+
+  // The native code of the trace which blockAt() each dispatcher, or
+  // NULL. The JIT jumps through this.
+  void** jitEntries() { return jit_entries_.data(); }
+
+  // Called for stores into the cells of the dispatchers.
+  void noteWrite(int x, int y) {
+    if (x < kWidth && y >= beginRow() && y < endRow()) {
+      enabled_ = false;
+      fill(jit_entries_.begin(), jit_entries_.end(), (void*)NULL);
+    }
+  }
+
+private:
+  // Whether row |y| of |code| starts with the |kWidth| ops of |ops|.
+  static bool rowStartsWith(const Grid& code, int y, const char* ops) {
+    if (code.rowSize(y) < kWidth)
+      return false;
+    for (int x = 0; x < kWidth; x++) {
+      if (code.op(x, y) != ops[x])
+        return false;
+    }
+    return true;
+  }
+
+  bool enabled_;
+  // The top row of each dispatcher.
+  vector<int> rows_;
+  // The index of the dispatcher at each row, or -1.
+  vector<int> top_;
+  // The first and last dispatchers chained with each.
+  vector<int> first_;
+  vector<int> last_;
+  vector<void*> jit_entries_;
+};
+
+// Trace cache. A trace is the straight run of cells starting from an
+// entry cell and direction, predecoded into ops so it can be replayed
+// without going back to the grid. Constant pushes are folded, and 'g'
+// and 'p' with constant coordinates are fused with their pushes. A trace
+// ends with a '_' or '|', before other ops whose effect depends on
+// runtime values ('?', '@', '&', '~'), and before any step which would
+// wrap around or skip short rows. Rows never shrink, so a trace stays
+// valid until 'p' writes one of the cells it covers.
+
+enum TraceOpType {
+  T_PUSH,
+  T_ADD,
+  T_SUB,
+  T_MUL,
+  T_DIV,
+  T_MOD,
+  T_GT,
+  T_NOT,
+  T_DUP,
+  T_SWAP,
+  T_POP,
+  T_GET,
+  T_PUT,
+  T_GETC,
+  T_PUTC,
+  T_OUTC,
+  T_OUTI,
+  // Only at the end of a trace.
+  T_HBRANCH,
+  T_VBRANCH,
+};
+
+struct TraceOp {
+  int type;
+  // The constant of T_PUSH, or the coordinates of T_GETC and T_PUTC.
+  int a, b;
+  // Where to resume when a 'p' invalidates the running trace.
+  int x, y, vx, vy;
+};
+
+struct Trace;
+
+class Interpreter;
+
+typedef int (*JitFunc)(int* stack, int64_t* sp, int64_t cap, Trace** exit,
+                       Interpreter* m);
+
+// A jump at the end of a trace's native code which goes to another
+// trace's code once that is compiled. |orig| is what it does until then.
+struct JitLink {
+  unsigned char* at;
+  unsigned char orig[5];
+};
+
+struct Trace {
+  uint64_t key;
+  vector<TraceOp> ops;
+  vector<pair<int, int> > cells;
+  // The cell the IP is left at. If |exit_done| is set, the op at the cell
+  // was already run and only the step remains. A trace ending with a
+  // branch takes its direction from the branch.
+  int exit_x, exit_y, exit_vx, exit_vy;
+  bool exit_done;
+  bool alive;
+  // How many times the trace was run, and its native code once it got hot.
+  int runs;
+  JitFunc jit;
+  // Where other traces' native code jumps into, and those jumps.
+  unsigned char* jit_body;
+  vector<JitLink> incoming;
+  // The size of the native code, and the keys of the traces its exits
+  // may be linked to.
+  size_t jit_size;
+  vector<uint64_t> outgoing;
+  // The most values the trace can push, counting pops of an empty stack.
+  int max_push;
+  // The traces which were run right after this one, so the next trace is
+  // usually found without a hash lookup. They are valid only while
+  // |link_gen| matches the machine's |trace_gen_|.
+  uint64_t link_keys[2];
+  Trace* links[2];
+  unsigned link_gen;
+};
+
+class Jit;
+
+// What is behind a Machine: the Befunge space, the IP, the stack, and
+// the caches built while running. Interpreters share nothing, so several
+// can run on threads of their own. Standard I/O goes through |out| and
+// |in|.
+class Interpreter {
+public:
+  static const int kTimedOut = Machine::kTimedOut;
+
+  Interpreter(const Options& opts, Output* out, Input* in);
+  ~Interpreter();
+
+  // Starts from |prog|, the grid of a Program.
+  void load(const Grid& prog);
+  // Loads a snapshot written by --checkpoint instead of a program.
+  bool restore(const char* path);
+
+  // Runs the program until it ends, and returns its exit status.
+  int run();
+
+  void requestStop() { stop_requested_ = true; }
+  void requestCheckpoint() { checkpoint_requested_ = true; }
+
+  void dump();
+  void writeProfile();
+  void writeStats();
+
+  uint64_t steps() const { return steps_; }
+
+private:
+  friend class Jit;
+
+  // How many steps run() takes between looking at the clock.
+  static const int kDeadlineInterval = 4096;
+
+  void start();
+  int halt(int status) {
+    halted_ = true;
+    status_ = status;
+    return status;
+  }
+
+  void step();
+  int get();
+  void push(int v);
+  int pop();
+  void dumpRows(int y0, int y1, int x0, int x1, bool numbered);
+  void dumpIP();
+  void dumpValues();
+  void dumpRegisters();
+  void dumpRegion(int r);
+  void writeSnapshot(const char* path);
+  void writeCheckpoint();
+  void checkpointAtEof();
+  void updateStats(double now);
+  bool restoreCheckpoint(const char* path);
+  vector<string> loadedLines() const;
+  int handleUnsupportedOp();
+  int getCell(int x, int y);
+  void putCell(int x, int y, int v);
+
+  bool isTraceable(int x, int y);
+  unsigned char& coveredAt(int x, int y);
+  bool traceStep(int& x, int& y, int dx, int dy);
+  void invalidateTraces(int x, int y);
+  Trace* recordTrace(int x, int y, int dx, int dy);
+  Trace* findTrace(Trace* prev);
+  bool runTrace(const Trace* t);
+  void jitForget(Trace* t);
+#if BEFUNGE_THREADED
+  bool poll(double deadline, int* status);
+  int runThreaded(double deadline);
+#endif
+  void jitSetIP(const Trace* t, int index);
+  bool runJit(Trace** t);
+
+  Options opts_;
+  Output* out_;
+  Input* in_;
+  Grid code_;
+  int ix_, iy_;
+  int vx_, vy_;
+  Stack st_;
+  Profiler profiler_;
+  Stats stats_;
+  // What dump() shows, as DumpPart.
+  vector<int> dump_parts_;
+  uint64_t steps_;
+  bool checkpointed_at_eof_;
+  unsigned seed_;
+  // Set by requestStop() and requestCheckpoint().
+  atomic<bool> stop_requested_;
+  atomic<bool> checkpoint_requested_;
+
+  // Cells which some trace covers, indexed like the dense part of
+  // |code_|. Traces only cover the program as it was loaded, so this
+  // never grows. The cells of the block dispatchers are marked as well.
+  // These are bytes rather than bits so the JIT can test them.
+  vector<unsigned char> covered_;
+  // The live traces which cover each cell, by cellKey().
+  unordered_map<uint64_t, vector<Trace*> > traces_by_cell_;
+  Dispatcher dispatch_;
+  unordered_map<uint64_t, Trace*> traces_;
+  const Trace* running_trace_;
+  // Bumped whenever traces are freed.
+  unsigned trace_gen_;
+  Jit* jit_;
+  // The stack size while native code runs, which it stores before 'p'.
+  int64_t jit_sp_;
+  // The traces native code may still enter before it returns to poll.
+  int32_t jit_countdown_;
+
+  // Set when the program stops other than by '@', with its exit status.
+  bool halted_;
+  int status_;
+};
+
+inline void Interpreter::step() {
+  if (vx_) {
+    ix_ += vx_;
+    if (ix_ < 0)
+      ix_ = code_.rowSize(iy_) - 1;
+    else if (ix_ >= code_.rowSize(iy_))
+      ix_ = 0;
+    return;
+  }
+  iy_ = vy_ > 0 ? code_.nextRow(ix_, iy_) : code_.prevRow(ix_, iy_);
+}
+
+inline int Interpreter::get() {
+  assert(iy_ < code_.height());
+  if (ix_ < code_.rowSize(iy_))
+    return code_.get(ix_, iy_);
+  else
+    return 0;
+}
+
+inline void Interpreter::push(int v) {
+  st_.push(v);
+}
+
+inline int Interpreter::pop() {
+  return st_.pop();
+}
+
+// The parts of Options::dump_parts. The memory regions of
+// befunge_profile.h come first, as their Profiler::Region.
+enum DumpPart {
+  D_ALL = Profiler::NUM_REGIONS, D_IP, D_VALUES, NUM_DUMP_PARTS
+};
+
+static const char* dumpPartName(int p) {
+  static const char* const kNames[] = { "all", "ip", "values" };
+  return p < D_ALL ? Profiler::regionName(p) : kNames[p - D_ALL];
+}
+
+// Parses a comma separated list of parts. Returns false if one isn't
+// known.
+static bool parseDumpParts(const char* spec, vector<int>* parts) {
+  parts->clear();
+  while (*spec) {
+    const char* end = strchr(spec, ',');
+    if (!end)
+      end = spec + strlen(spec);
+    string name(spec, end);
+    int p = 0;
+    while (p < NUM_DUMP_PARTS && name != dumpPartName(p))
+      p++;
+    if (p == NUM_DUMP_PARTS)
+      return false;
+    parts->push_back(p);
+    spec = *end ? end + 1 : end;
+  }
+  return true;
+}
+
+bool validDumpParts(const char* parts) {
+  vector<int> unused;
+  return parseDumpParts(parts, &unused);
+}
+
+void Interpreter::dump() {
+  if (opts_.core_path) {
+    writeSnapshot(opts_.core_path);
+    fprintf(stderr, "dumped core to %s\n", opts_.core_path);
+    return;
+  }
+  for (int p : dump_parts_) {
+    switch (p) {
+    case D_ALL:
+      //fprintf(stderr, "%sc", "\x1b");
+      fprintf(stderr, "=== MEMORY ===\n");
+      dumpRows(0, code_.height(), 0, INT_MAX, false);
+      dumpValues();
+      break;
+    case D_IP:
+      dumpIP();
+      break;
+    case D_VALUES:
+      dumpValues();
+      break;
+    case Profiler::R_REG:
+      dumpRegisters();
+      break;
+    case Profiler::R_CODE:
+      fprintf(stderr, "=== CODE ===\n");
+      dumpRows(0, code_.denseHeight(), 0, code_.denseWidth(), true);
+      break;
+    default:
+      dumpRegion(p);
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+// Prints the cells of rows [|y0|, |y1|) and columns [|x0|, |x1|), with
+// the IP and control characters in colour.
+void Interpreter::dumpRows(int y0, int y1, int x0, int x1, bool numbered) {
+  for (int y = y0; y < y1; y++) {
+    if (numbered)
+      fprintf(stderr, "%6d ", y);
+    int end = min(code_.rowSize(y), x1);
+    for (int x = x0; x < end; x++) {
+      char c = code_.get(x, y);
+      bool color = true;
+      if (x == ix_ && y == iy_) {
+        fprintf(stderr, "\x1b[41m");
+      } else if (c < 32) {
+        fprintf(stderr, "\x1b[30m\x1b[47m");
+        c = c < 10 ? '0' + c : 'A' + c - 10;
+      } else {
+        color = false;
+      }
+      fputc(c, stderr);
+      if (color) {
+        fprintf(stderr, "\x1b[39m");
+        fprintf(stderr, "\x1b[49m");
+      }
+    }
+    fputc('\n', stderr);
+  }
+}
+
+// The cells around the IP.
+void Interpreter::dumpIP() {
+  static const int kRows = 5;
+  static const int kColumns = 40;
+  const char* dir = vx_ > 0 ? "east" : vx_ < 0 ? "west" :
+                    vy_ > 0 ? "south" : "north";
+  int y0 = max(0, iy_ - kRows);
+  int y1 = min(code_.height(), iy_ + kRows + 1);
+  int x0 = max(0, ix_ - kColumns);
+  fprintf(stderr, "=== IP %d,%d going %s (from column %d) ===\n",
+          ix_, iy_, dir, x0);
+  dumpRows(y0, y1, x0, ix_ + kColumns + 1, true);
+}
+
+void Interpreter::dumpValues() {
+  fprintf(stderr, "=== STACK ===\n");
+  for (size_t i = 0; i < st_.size(); i++) {
+    fprintf(stderr, "%d ", st_[i]);
+  }
+  fprintf(stderr, "\n");
+}
+
+// The first two rows as numbers, where bc2bef keeps its registers.
+void Interpreter::dumpRegisters() {
+  fprintf(stderr, "=== REG ===\n");
+  for (int y = 0; y < min(2, code_.height()); y++) {
+    fprintf(stderr, "%6d", y);
+    for (int x = 0; x < code_.rowSize(y); x++)
+      fprintf(stderr, " %d", code_.get(x, y));
+    fputc('\n', stderr);
+  }
+}
+
+// The nonzero cells of a memory region below the code, by their bc2bef
+// address, or by "x,y" for R_OTHER.
+void Interpreter::dumpRegion(int r) {
+  string name = dumpPartName(r);
+  transform(name.begin(), name.end(), name.begin(), ::toupper);
+  fprintf(stderr, "=== %s ===\n", name.c_str());
+  int height = code_.denseHeight();
+  vector<pair<int64_t, int>> cells;
+  code_.forEachSparse([&](int x, int y, int v) {
+    if (Profiler::regionOf(x, y, height) != r)
+      return;
+    if (r == Profiler::R_OTHER)
+      cells.push_back(make_pair((int64_t)y << 32 | x, v));
+    else
+      cells.push_back(make_pair((int64_t)y * 9 + x % 9, v));
+  });
+  sort(cells.begin(), cells.end());
+  for (auto& c : cells) {
+    if (r == Profiler::R_OTHER) {
+      fprintf(stderr, "%d,%d %d\n", (int)(c.first & 0xffffffff),
+              (int)(c.first >> 32), c.second);
+    } else {
+      fprintf(stderr, "%lld %d\n", (long long)c.first, c.second);
+    }
+  }
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void Interpreter::writeProfile() {
+  profiler_.report(opts_.profile_path);
+}
+
+void Interpreter::writeStats() {
+  updateStats(now());
+}
+
+void Interpreter::updateStats(double now) {
+  if (!stats_.update(now, steps_, st_.size(), st_.capacity(), code_.height(),
+                     code_.cellsAllocated())) {
+    fprintf(stderr, "failed to write: %s\n", opts_.stats_path);
+  }
+}
+
+// Writes the state with the IP at the cell about to run.
+void Interpreter::writeSnapshot(const char* path) {
+  out_->flush();
+  SnapshotWriter w;
+  w.putInt(ix_);
+  w.putInt(iy_);
+  w.putInt(vx_);
+  w.putInt(vy_);
+  code_.save(&w);
+  w.putUint(st_.size());
+  for (size_t i = 0; i < st_.size(); i++)
+    w.putInt(st_[i]);
+  w.putBytes(in_->pending());
+  if (!w.writeTo(path))
+    fprintf(stderr, "failed to write: %s\n", path);
+}
+
+void Interpreter::writeCheckpoint() {
+  writeSnapshot(opts_.checkpoint_path);
+}
+
+// The first time '~' or '&' finds no more input, the program has usually
+// read its prelude and is waiting for real work, which is a good state
+// to resume other inputs from.
+void Interpreter::checkpointAtEof() {
+  if (opts_.checkpoint_path && !checkpointed_at_eof_) {
+    checkpointed_at_eof_ = true;
+    writeCheckpoint();
+  }
+}
+
+// Loads a snapshot into the empty state.
+bool Interpreter::restoreCheckpoint(const char* path) {
+  SnapshotReader r;
+  if (!r.readFrom(path))
+    return false;
+  ix_ = r.getInt();
+  iy_ = r.getInt();
+  vx_ = r.getInt();
+  vy_ = r.getInt();
+  if (!code_.restore(&r))
+    return false;
+  uint64_t n = r.getUint();
+  for (uint64_t i = 0; i < n && r.ok(); i++)
+    push(r.getInt());
+  if (!in_->setPending(r.getBytes()) || !r.ok())
+    return false;
+  return !(ix_ < 0 || iy_ < 0 || iy_ >= code_.height() ||
+           abs(vx_) + abs(vy_) != 1);
+}
+
+// The program as text, as if it had been loaded from a file.
+vector<string> Interpreter::loadedLines() const {
+  vector<string> lines;
+  for (int y = 0; y < code_.denseHeight(); y++) {
+    string l;
+    int size = min(code_.rowSize(y), code_.denseWidth());
+    for (int x = 0; x < size; x++) {
+      int c = code_.get(x, y);
+      l += (char)(c >= 0 && c < 256 ? c : 0);
+    }
+    lines.push_back(l);
+  }
+  return lines;
+}
+
+int Interpreter::handleUnsupportedOp() {
+  char op = code_.get(ix_, iy_);
+  dump();
+  fprintf(stderr,
+          "this implementation doesn't support '%c' (%d) @%d,%d\n",
+          op, op, ix_, iy_);
+  return halt(1);
+}
+
+inline int Interpreter::getCell(int x, int y) {
+  if (opts_.stats_path)
+    stats_.countGet(x, y);
+  return code_.get(x, y);
+}
+
+inline void Interpreter::putCell(int x, int y, int v) {
+  if (opts_.stats_path)
+    stats_.countPut(x, y);
+  if (y < 0 || x < 0) {
+    dump();
+    fprintf(stderr, "negative 'p' isn't supported x=%d y=%d\n", x, y);
+    halt(1);
+    return;
+  }
+  code_.put(x, y, v);
+  if (code_.isDense(x, y) && covered_[y * code_.denseWidth() + x])
+    invalidateTraces(x, y);
+}
+
+static const int kMaxTraceCells = 4096;
+
+static inline uint64_t cellKey(int x, int y) {
+  return (uint64_t)(uint32_t)y << 32 | (uint32_t)x;
+}
+
+static inline uint64_t traceKey(int x, int y, int dx, int dy) {
+  int dir = dx == 1 ? 0 : dx == -1 ? 1 : dy == 1 ? 2 : 3;
+  return cellKey(x, y) << 2 | dir;
+}
+
+bool Interpreter::isTraceable(int x, int y) {
+  return code_.isDense(x, y) && x < code_.rowSize(y);
+}
+
+inline unsigned char& Interpreter::coveredAt(int x, int y) {
+  return covered_[y * code_.denseWidth() + x];
+}
+
+// Moves to the next cell only if it is a plain step to a neighbor within
+// the loaded program. Traces end before dispatchers so they can jump.
+bool Interpreter::traceStep(int& x, int& y, int dx, int dy) {
+  int nx = x + dx;
+  int ny = y + dy;
+  if (nx < 0 || ny < 0 || !isTraceable(nx, ny) ||
+      dispatch_.isEntry(nx, ny)) {
+    return false;
+  }
+  x = nx;
+  y = ny;
+  return true;
+}
+
+void Interpreter::invalidateTraces(int x, int y) {
+  dispatch_.noteWrite(x, y);
+  coveredAt(x, y) = false;
+  auto found = traces_by_cell_.find(cellKey(x, y));
+  if (found == traces_by_cell_.end())
+    return;
+  vector<Trace*> ts;
+  ts.swap(found->second);
+  traces_by_cell_.erase(found);
+  for (Trace* t : ts) {
+    // Drop |t| from the other cells it covers, as it may be freed below.
+    for (const pair<int, int>& c : t->cells) {
+      auto other = traces_by_cell_.find(cellKey(c.first, c.second));
+      if (other == traces_by_cell_.end())
+        continue;
+      vector<Trace*>& v = other->second;
+      v.erase(remove(v.begin(), v.end(), t), v.end());
+      if (v.empty())
+        traces_by_cell_.erase(other);
+    }
+    traces_.erase(t->key);
+    trace_gen_++;
+    if (t->jit)
+      jitForget(t);
+    // The running trace is freed once it bails out.
+    t->alive = false;
+    if (t != running_trace_)
+      delete t;
+  }
+}
+
+static void emitTraceOp(Trace* t, int type, int a, int b,
+                        int x, int y, int dx, int dy) {
+  TraceOp op = { type, a, b, x, y, dx, dy };
+  t->ops.push_back(op);
+}
+
+static bool foldTraceOp(int op, int a, int b, int* r) {
+  switch (op) {
+  case '+': *r = a + b; return true;
+  case '-': *r = a - b; return true;
+  case '*': *r = a * b; return true;
+  case '`': *r = a > b; return true;
+  // Leave traps for division by zero to the runtime.
+  case '/':
+    if (b == 0 || (b == -1 && a == INT_MIN))
+      return false;
+    *r = a / b;
+    return true;
+  case '%':
+    if (b == 0 || (b == -1 && a == INT_MIN))
+      return false;
+    *r = a % b;
+    return true;
+  }
+  return false;
+}
+
+Trace* Interpreter::recordTrace(int x, int y, int dx, int dy) {
+  Trace* t = new Trace();
+  t->key = traceKey(x, y, dx, dy);
+  t->alive = true;
+  t->exit_done = false;
+  t->runs = 0;
+  t->jit = NULL;
+  t->jit_body = NULL;
+  t->jit_size = 0;
+  t->max_push = 0;
+  t->links[0] = t->links[1] = NULL;
+  t->link_gen = trace_gen_;
+  // The number of T_PUSH at the end of |t->ops| whose values are still on
+  // the stack, and hence can be folded into the next op.
+  int nconst = 0;
+  for (int n = 0;; n++) {
+    if (n >= kMaxTraceCells || !isTraceable(x, y))
+      break;
+
+    int op = code_.get(x, y);
+    int sx = x;
+    int sy = y;
+    size_t nops = t->ops.size();
+    switch (op) {
+    case '<': dx = -1; dy = 0; break;
+    case '>': dx = 1; dy = 0; break;
+    case '^': dx = 0; dy = -1; break;
+    case 'v': dx = 0; dy = 1; break;
+    case ' ': break;
+
+    case '_':
+    case '|':
+      emitTraceOp(t, op == '_' ? T_HBRANCH : T_VBRANCH, 0, 0, x, y, dx, dy);
+      t->cells.push_back(make_pair(x, y));
+      t->exit_done = true;
+      goto stop;
+
+    case '#':
+      if (!traceStep(x, y, dx, dy))
+        goto stop;
+      break;
+
+    case '"': {
+      vector<int> str;
+      for (;;) {
+        if (!traceStep(x, y, dx, dy)) {
+          x = sx;
+          y = sy;
+          goto stop;
+        }
+        int c = code_.get(x, y);
+        if (c == '"')
+          break;
+        str.push_back(c);
+      }
+      for (int c : str)
+        emitTraceOp(t, T_PUSH, c, 0, x, y, dx, dy);
+      nconst += str.size();
+      // The covered cells are recorded below, so rewind to the opening
+      // quote for a while.
+      int ex = x;
+      int ey = y;
+      x = sx;
+      y = sy;
+      for (;;) {
+        t->cells.push_back(make_pair(x, y));
+        if (x == ex && y == ey)
+          break;
+        traceStep(x, y, dx, dy);
+      }
+      goto next;
+    }
+
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      emitTraceOp(t, T_PUSH, op - '0', 0, x, y, dx, dy);
+      nconst++;
+      break;
+
+    case '+': case '-': case '*': case '/': case '%': case '`': {
+      int r;
+      if (nconst >= 2 &&
+          foldTraceOp(op, t->ops[nops - 2].a, t->ops[nops - 1].a, &r)) {
+        t->ops.pop_back();
+        t->ops.back().a = r;
+        nconst--;
+        break;
+      }
+      int type = (op == '+' ? T_ADD : op == '-' ? T_SUB :
+                  op == '*' ? T_MUL : op == '/' ? T_DIV :
+                  op == '%' ? T_MOD : T_GT);
+      emitTraceOp(t, type, 0, 0, x, y, dx, dy);
+      nconst = 0;
+      break;
+    }
+    case '!':
+      if (nconst) {
+        t->ops.back().a = !t->ops.back().a;
+        break;
+      }
+      emitTraceOp(t, T_NOT, 0, 0, x, y, dx, dy);
+      break;
+    case ':':
+      if (nconst) {
+        t->ops.push_back(t->ops.back());
+        nconst++;
+        break;
+      }
+      emitTraceOp(t, T_DUP, 0, 0, x, y, dx, dy);
+      break;
+    case '\\':
+      if (nconst >= 2) {
+        swap(t->ops[nops - 2].a, t->ops[nops - 1].a);
+        break;
+      }
+      emitTraceOp(t, T_SWAP, 0, 0, x, y, dx, dy);
+      nconst = 0;
+      break;
+    case '$':
+      if (nconst) {
+        t->ops.pop_back();
+        nconst--;
+        break;
+      }
+      emitTraceOp(t, T_POP, 0, 0, x, y, dx, dy);
+      break;
+
+    case 'g':
+    case 'p': {
+      bool is_get = op == 'g';
+      if (nconst >= 2) {
+        int cx = t->ops[nops - 2].a;
+        int cy = t->ops[nops - 1].a;
+        t->ops.resize(nops - 2);
+        emitTraceOp(t, is_get ? T_GETC : T_PUTC, cx, cy, x, y, dx, dy);
+      } else {
+        emitTraceOp(t, is_get ? T_GET : T_PUT, 0, 0, x, y, dx, dy);
+      }
+      nconst = 0;
+      break;
+    }
+
+    case ',':
+      emitTraceOp(t, T_OUTC, 0, 0, x, y, dx, dy);
+      nconst = 0;
+      break;
+    case '.':
+      emitTraceOp(t, T_OUTI, 0, 0, x, y, dx, dy);
+      nconst = 0;
+      break;
+
+    default:
+      goto stop;
+    }
+
+    t->cells.push_back(make_pair(sx, sy));
+  next:
+    if (!traceStep(x, y, dx, dy)) {
+      t->exit_done = true;
+      break;
+    }
+  }
+
+stop:
+  t->exit_x = x;
+  t->exit_y = y;
+  t->exit_vx = dx;
+  t->exit_vy = dy;
+
+  for (const TraceOp& op : t->ops) {
+    if (op.type == T_DUP || op.type == T_SWAP)
+      t->max_push += 2;
+    else if (op.type <= T_NOT || op.type == T_GET || op.type == T_GETC)
+      t->max_push++;
+  }
+
+  for (const pair<int, int>& c : t->cells) {
+    coveredAt(c.first, c.second) = true;
+    vector<Trace*>& v = traces_by_cell_[cellKey(c.first, c.second)];
+    // A trace may cross a cell twice.
+    if (v.empty() || v.back() != t)
+      v.push_back(t);
+  }
+  traces_[t->key] = t;
+  return t;
+}
+
+// Returns the trace starting at the IP, which |prev| may have linked.
+Trace* Interpreter::findTrace(Trace* prev) {
+  uint64_t key = traceKey(ix_, iy_, vx_, vy_);
+  if (prev) {
+    if (prev->link_gen != trace_gen_) {
+      prev->links[0] = prev->links[1] = NULL;
+      prev->link_gen = trace_gen_;
+    }
+    if (prev->links[0] && prev->link_keys[0] == key)
+      return prev->links[0];
+    if (prev->links[1] && prev->link_keys[1] == key)
+      return prev->links[1];
+  }
+
+  auto found = traces_.find(key);
+  Trace* t = (found != traces_.end() ?
+              found->second : recordTrace(ix_, iy_, vx_, vy_));
+  if (prev) {
+    prev->link_keys[1] = prev->link_keys[0];
+    prev->links[1] = prev->links[0];
+    prev->link_keys[0] = key;
+    prev->links[0] = t;
+  }
+  return t;
+}
+
+// Replays |t| and leaves the IP at its exit. Returns false if a 'p' in
+// the trace invalidated it, in which case the IP is left at the 'p'. The
+// top of the stack stays in a register while the trace runs.
+bool Interpreter::runTrace(const Trace* t) {
+  int dx = t->exit_vx;
+  int dy = t->exit_vy;
+  if (opts_.stats_path)
+    steps_ += t->cells.size();
+  st_.reserve(t->max_push);
+  TosCache c(&st_);
+  for (const TraceOp& op : t->ops) {
+    switch (op.type) {
+    case T_PUSH:
+      c.push(op.a);
+      break;
+    case T_ADD: {
+      int y = c.pop();
+      c.top() += y;
+      break;
+    }
+    case T_SUB: {
+      int y = c.pop();
+      c.top() -= y;
+      break;
+    }
+    case T_MUL: {
+      int y = c.pop();
+      c.top() *= y;
+      break;
+    }
+    case T_DIV: {
+      int y = c.pop();
+      c.top() /= y;
+      break;
+    }
+    case T_MOD: {
+      int y = c.pop();
+      c.top() %= y;
+      break;
+    }
+    case T_GT: {
+      int y = c.pop();
+      int& x = c.top();
+      x = x > y;
+      break;
+    }
+    case T_NOT: {
+      int& x = c.top();
+      x = !x;
+      break;
+    }
+    case T_DUP:
+      c.push(c.top());
+      break;
+    case T_SWAP: {
+      int y = c.pop();
+      int x = c.pop();
+      c.push(y);
+      c.push(x);
+      break;
+    }
+    case T_POP:
+      c.pop();
+      break;
+    case T_GET: {
+      int y = c.pop();
+      int& x = c.top();
+      x = getCell(x, y);
+      break;
+    }
+    case T_GETC:
+      c.push(getCell(op.a, op.b));
+      break;
+    case T_PUT:
+    case T_PUTC: {
+      int x = op.a;
+      int y = op.b;
+      if (op.type == T_PUT) {
+        y = c.pop();
+        x = c.pop();
+      }
+      int v = c.pop();
+      ix_ = op.x;
+      iy_ = op.y;
+      vx_ = op.vx;
+      vy_ = op.vy;
+      c.flush();
+      putCell(x, y, v);
+      if (halted_ || !t->alive)
+        return false;
+      break;
+    }
+    case T_OUTC:
+      out_->putChar(c.pop());
+      break;
+    case T_OUTI:
+      out_->putInt(c.pop());
+      break;
+    case T_HBRANCH:
+      dx = c.pop() ? -1 : 1;
+      dy = 0;
+      break;
+    case T_VBRANCH:
+      dx = 0;
+      dy = c.pop() ? -1 : 1;
+      break;
+    }
+  }
+  c.flush();
+  ix_ = t->exit_x;
+  iy_ = t->exit_y;
+  vx_ = dx;
+  vy_ = dy;
+  return true;
+}
+
+// A template JIT for hot traces (-j). Each trace op becomes a fixed
+// x86-64 sequence working on the operand stack in memory: rbx holds its
+// base, r12 its size and r14 its capacity, and rbp the Interpreter. 'g' and
+// 'p' outside the loaded program and output call back into the machine.
+// A trace ending with a branch jumps straight into the native code of the
+// trace taken next once that is compiled, so hot loops run without
+// leaving native code.
+//
+// The generated code returns to the interpreter with the trace it left
+// from, and one of the JitExit codes or the index of a 'p' which
+// invalidated that trace.
+//
+// Linked code counts the traces it enters in the Interpreter and comes
+// back with JIT_POLL before the next one every kDeadlineInterval entries,
+// so run() still sees the clock, stop requests and checkpoint requests.
+//
+// The code buffer is never writable and executable at once: pages are
+// made writable only while code is copied in or a jump is patched. The
+// code of invalidated traces is reused for later ones.
+
+enum JitExit {
+  JIT_END = -1,
+  JIT_TAKEN = -2,
+  JIT_NOT_TAKEN = -3,
+  JIT_GROW = -4,
+  JIT_POLL = -5,
+};
+
+static const int kJitThreshold = 8;
+static const size_t kJitBufSize = 64 << 20;
+
+class Jit {
+public:
+  explicit Jit(Interpreter* m)
+    : m_(m), buf_(NULL), used_(0),
+      page_size_(sysconf(_SC_PAGESIZE)) {
+  }
+
+  ~Jit() {
+    if (buf_)
+      munmap(buf_, kJitBufSize);
+  }
+
+  bool init() {
+#if defined(__x86_64__)
+    void* p = mmap(NULL, kJitBufSize, PROT_READ | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+      return false;
+    buf_ = (unsigned char*)p;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Returns false when the buffer is full.
+  bool compile(Trace* t) {
+    reclaim();
+    code_.clear();
+    stubs_.clear();
+    emit(0x55);                          // push rbp
+    emit(0x53);                          // push rbx
+    emit(0x41, 0x54);                    // push r12
+    emit(0x41, 0x55);                    // push r13
+    emit(0x41, 0x56);                    // push r14
+    emit(0x41, 0x57);                    // push r15
+    emit(0x48, 0x89, 0xfb);              // mov rbx, rdi
+    emit(0x49, 0x89, 0xf5);              // mov r13, rsi
+    emit(0x4d, 0x8b, 0x65, 0x00);        // mov r12, [r13]
+    emit(0x49, 0x89, 0xd6);              // mov r14, rdx
+    emit(0x49, 0x89, 0xcf);              // mov r15, rcx
+    emit(0x4c, 0x89, 0xc5);              // mov rbp, r8
+    emit(0x48, 0x83, 0xec, 0x08);        // sub rsp, 8
+
+    size_t body = code_.size();
+    emit(0xff, 0x8d);                    // dec dword [rbp+imm32]
+    emit32((char*)&m_->jit_countdown_ - (char*)m_);
+    emit(0x0f, 0x84);                    // jz rel32
+    addStub(JIT_POLL, 0, false);
+    if (m_->opts_.stats_path) {
+      emit(0x48, 0xb8);                  // mov rax, imm64
+      emit64((uint64_t)&m_->steps_);
+      emit(0x48, 0x81, 0x00);            // add qword [rax], imm32
+      emit32(t->cells.size());
+    }
+    emit(0x49, 0x8d, 0x84, 0x24);        // lea rax, [r12+imm32]
+    size_t max_push_pos = code_.size();
+    emit32(0);
+    emit(0x4c, 0x39, 0xf0);              // cmp rax, r14
+    emit(0x0f, 0x87);                    // ja rel32
+    addStub(JIT_GROW, 0, false);
+
+    known_ = 0;
+    for (size_t i = 0; i < t->ops.size(); i++) {
+      const TraceOp& op = t->ops[i];
+      // A constant followed by an arithmetic op becomes an immediate.
+      if (op.type == T_PUSH && i + 1 < t->ops.size() &&
+          emitArithImm(t->ops[i + 1].type, op.a)) {
+        i++;
+        continue;
+      }
+      emitOp(t, i);
+    }
+
+    if (!t->ops.empty() && (t->ops.back().type == T_HBRANCH ||
+                            t->ops.back().type == T_VBRANCH)) {
+      // emitOp left the popped condition in eax.
+      bool horizontal = t->ops.back().type == T_HBRANCH;
+      emit(0x85, 0xc0);                  // test eax, eax
+      emit(0x0f, 0x85);                  // jnz rel32
+      addBranchStub(t, JIT_TAKEN, horizontal ? -1 : 0, horizontal ? 0 : -1);
+      emit(0xe9);                        // jmp rel32
+      addBranchStub(t, JIT_NOT_TAKEN, horizontal ? 1 : 0, horizontal ? 0 : 1);
+    } else {
+      if (t->exit_done &&
+          m_->dispatch_.isEntry(t->exit_x + t->exit_vx,
+                                t->exit_y + t->exit_vy)) {
+        emitDispatch(t);
+      }
+      emit(0xe9);                        // jmp rel32
+      addStub(JIT_END, 0, false);
+    }
+    patch32(max_push_pos, t->max_push);
+
+    // Each stub returns |t| and its code. Linked stubs get their first
+    // instruction replaced by a jump to the next trace.
+    vector<size_t> stub_pos;
+    for (Stub& s : stubs_) {
+      patch32(s.jump, code_.size() - (s.jump + 4));
+      stub_pos.push_back(code_.size());
+      emit(0x48, 0xba);                  // mov rdx, imm64
+      emit64((uint64_t)t);
+      emit(0xb8);                        // mov eax, imm32
+      emit32(s.code);
+      emit(0xe9);                        // jmp rel32
+      s.jump = code_.size();
+      emit32(0);
+    }
+    size_t epilogue = code_.size();
+    emit(0x4d, 0x89, 0x65, 0x00);        // mov [r13], r12
+    emit(0x49, 0x89, 0x17);              // mov [r15], rdx
+    emit(0x48, 0x83, 0xc4, 0x08);        // add rsp, 8
+    emit(0x41, 0x5f);                    // pop r15
+    emit(0x41, 0x5e);                    // pop r14
+    emit(0x41, 0x5d);                    // pop r13
+    emit(0x41, 0x5c);                    // pop r12
+    emit(0x5b);                          // pop rbx
+    emit(0x5d);                          // pop rbp
+    emit(0xc3);                          // ret
+    for (const Stub& s : stubs_)
+      patch32(s.jump, epilogue - (s.jump + 4));
+
+    unsigned char* p = allocate(code_.size());
+    if (!p)
+      return false;
+    protect(p, code_.size(), true);
+    memcpy(p, code_.data(), code_.size());
+    protect(p, code_.size(), false);
+    t->jit = (JitFunc)p;
+    t->jit_body = p + body;
+    t->jit_size = code_.size();
+    int g = blockOf(t);
+    if (g >= 0)
+      m_->dispatch_.jitEntries()[g] = t->jit_body;
+
+    for (size_t i = 0; i < stubs_.size(); i++) {
+      if (!stubs_[i].linkable)
+        continue;
+      JitLink l;
+      l.at = p + stub_pos[i];
+      memcpy(l.orig, l.at, sizeof(l.orig));
+      t->outgoing.push_back(stubs_[i].next);
+      auto found = m_->traces_.find(stubs_[i].next);
+      if (found != m_->traces_.end() && found->second->jit)
+        link(l, found->second);
+      else
+        pending_[stubs_[i].next].push_back(l);
+    }
+    auto found = pending_.find(t->key);
+    if (found != pending_.end()) {
+      for (const JitLink& l : found->second)
+        link(l, t);
+      pending_.erase(found);
+    }
+    return true;
+  }
+
+  // Unlinks the jumps into |t|, which is being invalidated, and the ones
+  // out of it, whose code is reused once it can't be running any more.
+  void forget(Trace* t) {
+    int g = blockOf(t);
+    if (g >= 0 && m_->dispatch_.jitEntries()[g] == t->jit_body)
+      m_->dispatch_.jitEntries()[g] = NULL;
+    vector<JitLink>& pending = pending_[t->key];
+    for (const JitLink& l : t->incoming) {
+      protect(l.at, sizeof(l.orig), true);
+      memcpy(l.at, l.orig, sizeof(l.orig));
+      protect(l.at, sizeof(l.orig), false);
+      pending.push_back(l);
+    }
+    t->incoming.clear();
+
+    unsigned char* begin = (unsigned char*)t->jit;
+    unsigned char* end = begin + t->jit_size;
+    auto inside = [begin, end](const JitLink& l) {
+      return l.at >= begin && l.at < end;
+    };
+    for (uint64_t key : t->outgoing) {
+      auto found = pending_.find(key);
+      if (found != pending_.end()) {
+        vector<JitLink>& v = found->second;
+        v.erase(remove_if(v.begin(), v.end(), inside), v.end());
+      }
+      auto next = m_->traces_.find(key);
+      if (next != m_->traces_.end()) {
+        vector<JitLink>& v = next->second->incoming;
+        v.erase(remove_if(v.begin(), v.end(), inside), v.end());
+      }
+    }
+    t->outgoing.clear();
+    // |t| may be the trace whose code called us.
+    retired_.push_back(make_pair(begin - buf_, t->jit_size));
+  }
+
+private:
+  enum Reg {
+    EAX = 0,
+    ECX = 1,
+    EDX = 2,
+    ESI = 6,
+  };
+
+  // A jump to the exit code for |code|. |next| is the key of the trace
+  // to link to.
+  struct Stub {
+    size_t jump;
+    int code;
+    bool linkable;
+    uint64_t next;
+  };
+
+  void addStub(int code, uint64_t next, bool linkable) {
+    Stub s = { code_.size(), code, linkable, next };
+    stubs_.push_back(s);
+    emit32(0);
+  }
+
+  // The next trace is known only if the step after the branch is plain.
+  void addBranchStub(const Trace* t, int code, int dx, int dy) {
+    int x = t->exit_x;
+    int y = t->exit_y;
+    bool linkable = m_->traceStep(x, y, dx, dy);
+    addStub(code, traceKey(x, y, dx, dy), linkable);
+  }
+
+  // The dispatcher whose block |t| runs from its start, or -1.
+  int blockOf(const Trace* t) const {
+    if (t->cells.empty())
+      return -1;
+    int x = t->cells[0].first;
+    int y = t->cells[0].second;
+    if (t->key != traceKey(x, y, 1, 0))
+      return -1;
+    return m_->dispatch_.blockAt(x, y);
+  }
+
+  // Jumps to the block which the dispatcher after |t| reaches, if the
+  // trace there is compiled. Otherwise, this falls through to the exit
+  // and the interpreter jumps.
+  void emitDispatch(const Trace* t) {
+    int bias, range, base;
+    m_->dispatch_.reach(t->exit_x + t->exit_vx, t->exit_y + t->exit_vy,
+                   &bias, &range, &base);
+    emit(0x42, 0x8b, 0x44, 0xa3, 0xfc);  // mov eax, [rbx+r12*4-4]
+    emit(0x05);                          // add eax, imm32
+    emit32(bias);
+    emit(0x3d);                          // cmp eax, imm32
+    emit32(range);
+    emit(0x0f, 0x87);                    // ja rel32
+    addStub(JIT_END, 0, false);
+    emit(0x48, 0xb9);                    // mov rcx, imm64
+    emit64((uint64_t)(m_->dispatch_.jitEntries() + base));
+    emit(0x48, 0x8b, 0x0c, 0xc1);        // mov rcx, [rcx+rax*8]
+    emit(0x48, 0x85, 0xc9);              // test rcx, rcx
+    emit(0x0f, 0x84);                    // jz rel32
+    addStub(JIT_END, 0, false);
+    emit(0x49, 0x83, 0xec, 0x01);        // sub r12, 1
+    emit(0x49, 0x83, 0xd4, 0x00);        // adc r12, 0
+    emit(0xff, 0xe1);                    // jmp rcx
+  }
+
+  void link(const JitLink& l, Trace* next) {
+    protect(l.at, sizeof(l.orig), true);
+    l.at[0] = 0xe9;                      // jmp rel32
+    int rel = next->jit_body - (l.at + 5);
+    memcpy(l.at + 1, &rel, 4);
+    protect(l.at, sizeof(l.orig), false);
+    next->incoming.push_back(l);
+  }
+
+  // Makes the pages of |n| bytes from |p| writable, or executable again.
+  void protect(unsigned char* p, size_t n, bool writable) {
+    uintptr_t begin = (uintptr_t)p & ~(page_size_ - 1);
+    uintptr_t end = ((uintptr_t)p + n + page_size_ - 1) & ~(page_size_ - 1);
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    if (mprotect((void*)begin, end - begin, prot)) {
+      perror("mprotect");
+      abort();
+    }
+  }
+
+  // The first free range of |n| bytes, or NULL if the buffer is full.
+  unsigned char* allocate(size_t n) {
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+      if (it->second < n)
+        continue;
+      size_t at = it->first;
+      size_t left = it->second - n;
+      free_.erase(it);
+      if (left)
+        free_[at + n] = left;
+      return buf_ + at;
+    }
+    if (used_ + n > kJitBufSize)
+      return NULL;
+    used_ += n;
+    return buf_ + used_ - n;
+  }
+
+  // Frees the code forget() retired. Only called from compile(), when no
+  // native code runs.
+  void reclaim() {
+    for (const pair<size_t, size_t>& r : retired_) {
+      size_t at = r.first;
+      size_t n = r.second;
+      auto next = free_.lower_bound(at);
+      if (next != free_.end() && at + n == next->first) {
+        n += next->second;
+        free_.erase(next);
+      }
+      auto prev = free_.lower_bound(at);
+      if (prev != free_.begin() && (--prev)->first + prev->second == at) {
+        prev->second += n;
+      } else {
+        free_[at] = n;
+      }
+    }
+    retired_.clear();
+  }
+
+  void emitOp(Trace* t, size_t i) {
+    const TraceOp& op = t->ops[i];
+    switch (op.type) {
+    case T_PUSH:
+      emit(0x42, 0xc7, 0x04, 0xa3);      // mov dword [rbx+r12*4], imm32
+      emit32(op.a);
+      emit(0x49, 0xff, 0xc4);            // inc r12
+      pushed();
+      break;
+    case T_ADD:
+    case T_SUB:
+    case T_MUL:
+    case T_DIV:
+    case T_MOD:
+    case T_GT:
+      popTo(ECX);
+      popTo(EAX);
+      if (op.type == T_ADD) {
+        emit(0x01, 0xc8);                // add eax, ecx
+      } else if (op.type == T_SUB) {
+        emit(0x29, 0xc8);                // sub eax, ecx
+      } else if (op.type == T_MUL) {
+        emit(0x0f, 0xaf, 0xc1);          // imul eax, ecx
+      } else if (op.type == T_GT) {
+        emit(0x39, 0xc8);                // cmp eax, ecx
+        emitSetg();
+      } else {
+        emitDiv(op.type == T_MOD);
+      }
+      pushFrom(EAX);
+      break;
+    case T_NOT:
+      popTo(EAX);
+      emit(0x85, 0xc0);                  // test eax, eax
+      emit(0x0f, 0x94, 0xc0);            // sete al
+      emit(0x0f, 0xb6, 0xc0);            // movzx eax, al
+      pushFrom(EAX);
+      break;
+    case T_DUP:
+      popTo(EAX);
+      pushFrom(EAX);
+      pushFrom(EAX);
+      break;
+    case T_SWAP:
+      popTo(ECX);
+      popTo(EAX);
+      pushFrom(ECX);
+      pushFrom(EAX);
+      break;
+    case T_POP:
+      popTo(EAX);
+      break;
+    case T_GET:
+      popTo(EDX);
+      popTo(ESI);
+      call((void*)&jitGet);
+      pushFrom(EAX);
+      break;
+    case T_GETC:
+      // The stats count 'g' in jitGet.
+      if (m_->code_.isDense(op.a, op.b) && !m_->opts_.stats_path) {
+        emit(0x48, 0xb8);                // mov rax, imm64
+        emit64((uint64_t)m_->code_.denseCell(op.a, op.b));
+        emit(0x8b, 0x00);                // mov eax, [rax]
+      } else {
+        emit(0xbe);                      // mov esi, imm32
+        emit32(op.a);
+        emit(0xba);                      // mov edx, imm32
+        emit32(op.b);
+        call((void*)&jitGet);
+      }
+      pushFrom(EAX);
+      break;
+    case T_PUT:
+    case T_PUTC:
+      if (op.type == T_PUTC && m_->code_.isDense(op.a, op.b) &&
+          op.a < m_->code_.rowSize(op.b) && !m_->opts_.stats_path) {
+        // The row doesn't grow, so only the op byte and the covered
+        // check remain. The byte is 0 unless the value fits.
+        popTo(EDX);
+        emit(0x48, 0xb8);                // mov rax, imm64
+        emit64((uint64_t)m_->code_.denseCell(op.a, op.b));
+        emit(0x89, 0x10);                // mov [rax], edx
+        emit(0x0f, 0xbe, 0xc2);          // movsx eax, dl
+        emit(0x31, 0xc9);                // xor ecx, ecx
+        emit(0x39, 0xd0);                // cmp eax, edx
+        emit(0x0f, 0x44, 0xca);          // cmove ecx, edx
+        emit(0x48, 0xb8);                // mov rax, imm64
+        emit64((uint64_t)m_->code_.opCell(op.a, op.b));
+        emit(0x88, 0x08);                // mov [rax], cl
+        emit(0x48, 0xb8);                // mov rax, imm64
+        emit64((uint64_t)&m_->coveredAt(op.a, op.b));
+        emit(0x80, 0x38, 0x00);          // cmp byte [rax], 0
+        emit(0x74);                      // je rel8
+        size_t skip = code_.size();
+        emit(0);
+        emit(0xbe);                      // mov esi, imm32
+        emit32(op.a);
+        emit(0xba);                      // mov edx, imm32
+        emit32(op.b);
+        emit(0xb9);                      // mov ecx, imm32
+        emit32(i);
+        emit(0x49, 0xb8);                // mov r8, imm64
+        emit64((uint64_t)t);
+        call((void*)&jitCovered);
+        emitBail(i);
+        code_[skip] = code_.size() - (skip + 1);
+        break;
+      }
+      if (op.type == T_PUT) {
+        popTo(EDX);
+        popTo(ESI);
+      } else {
+        emit(0xbe);                      // mov esi, imm32
+        emit32(op.a);
+        emit(0xba);                      // mov edx, imm32
+        emit32(op.b);
+      }
+      popTo(ECX);
+      emit(0x41, 0xb8);                  // mov r8d, imm32
+      emit32(i);
+      emit(0x49, 0xb9);                  // mov r9, imm64
+      emit64((uint64_t)t);
+      // Let dump() see the right stack before a negative 'p' stops.
+      emit(0x4d, 0x89, 0x65, 0x00);      // mov [r13], r12
+      call((void*)&jitPut);
+      emitBail(i);
+      break;
+    case T_OUTC:
+    case T_OUTI:
+      popTo(ESI);
+      call(op.type == T_OUTC ? (void*)&jitOutChar : (void*)&jitOutInt);
+      break;
+    case T_HBRANCH:
+    case T_VBRANCH:
+      popTo(EAX);
+      break;
+    }
+  }
+
+  // Emits a T_PUSH of |v| followed by |type| as one op if possible.
+  bool emitArithImm(int type, int v) {
+    switch (type) {
+    case T_ADD:
+    case T_SUB:
+    case T_MUL:
+    case T_GT:
+      popTo(EAX);
+      if (type == T_ADD) {
+        emit(0x05);                      // add eax, imm32
+      } else if (type == T_SUB) {
+        emit(0x2d);                      // sub eax, imm32
+      } else if (type == T_MUL) {
+        emit(0x69, 0xc0);                // imul eax, eax, imm32
+      } else {
+        emit(0x3d);                      // cmp eax, imm32
+      }
+      emit32(v);
+      if (type == T_GT)
+        emitSetg();
+      break;
+    case T_DIV:
+    case T_MOD:
+      popTo(EAX);
+      emit(0xb9);                        // mov ecx, imm32
+      emit32(v);
+      emitDiv(type == T_MOD);
+      break;
+    default:
+      return false;
+    }
+    pushFrom(EAX);
+    return true;
+  }
+
+  void emitSetg() {
+    emit(0x0f, 0x9f, 0xc0);              // setg al
+    emit(0x0f, 0xb6, 0xc0);              // movzx eax, al
+  }
+
+  // Divides eax by ecx like the interpreter, trapping on zero.
+  void emitDiv(bool mod) {
+    emit(0x99);                          // cdq
+    emit(0xf7, 0xf9);                    // idiv ecx
+    if (mod)
+      emit(0x89, 0xd0);                  // mov eax, edx
+  }
+
+  // Leaves the native code if the helper just called returned non-zero.
+  void emitBail(int index) {
+    emit(0x85, 0xc0);                    // test eax, eax
+    emit(0x0f, 0x85);                    // jnz rel32
+    addStub(index, 0, false);
+  }
+
+  void emit(unsigned char b) {
+    code_.push_back(b);
+  }
+
+  void emit(unsigned char b0, unsigned char b1) {
+    emit(b0);
+    emit(b1);
+  }
+
+  void emit(unsigned char b0, unsigned char b1, unsigned char b2) {
+    emit(b0, b1);
+    emit(b2);
+  }
+
+  void emit(unsigned char b0, unsigned char b1, unsigned char b2,
+            unsigned char b3) {
+    emit(b0, b1);
+    emit(b2, b3);
+  }
+
+  void emit(unsigned char b0, unsigned char b1, unsigned char b2,
+            unsigned char b3, unsigned char b4) {
+    emit(b0, b1, b2, b3);
+    emit(b4);
+  }
+
+  void emit32(int v) {
+    for (int i = 0; i < 4; i++)
+      emit((v >> (i * 8)) & 255);
+  }
+
+  void emit64(uint64_t v) {
+    emit32(v);
+    emit32(v >> 32);
+  }
+
+  void patch32(size_t pos, int v) {
+    for (int i = 0; i < 4; i++)
+      code_[pos + i] = (v >> (i * 8)) & 255;
+  }
+
+  // Pops into |r|. Popping an empty stack reads 0 from the guard region
+  // below the base, and the borrow of the decrement is added back. Values
+  // pushed earlier in the same trace are popped plainly.
+  void popTo(Reg r) {
+    if (known_) {
+      known_--;
+      emit(0x49, 0xff, 0xcc);            // dec r12
+      emit(0x42, 0x8b, 0x04 | r << 3, 0xa3);  // mov r, [rbx+r12*4]
+      return;
+    }
+    emit(0x42, 0x8b, 0x44 | r << 3, 0xa3, 0xfc);  // mov r, [rbx+r12*4-4]
+    emit(0x49, 0x83, 0xec, 0x01);        // sub r12, 1
+    emit(0x49, 0x83, 0xd4, 0x00);        // adc r12, 0
+  }
+
+  void pushFrom(Reg r) {
+    emit(0x42, 0x89, 0x04 | r << 3, 0xa3);  // mov [rbx+r12*4], r
+    emit(0x49, 0xff, 0xc4);              // inc r12
+    pushed();
+  }
+
+  void pushed() {
+    known_++;
+  }
+
+  // Calls a helper with the machine as the first argument.
+  void call(void* fn) {
+    emit(0x48, 0x89, 0xef);              // mov rdi, rbp
+    emit(0x48, 0xb8);                    // mov rax, imm64
+    emit64((uint64_t)fn);
+    emit(0xff, 0xd0);                    // call rax
+  }
+
+  static int jitGet(Interpreter* m, int x, int y);
+  static int jitPut(Interpreter* m, int x, int y, int v, int index, Trace* t);
+  static int jitCovered(Interpreter* m, int x, int y, int index, Trace* t);
+  static void jitOutChar(Interpreter* m, int c);
+  static void jitOutInt(Interpreter* m, int v);
+
+  Interpreter* m_;
+  unsigned char* buf_;
+  // The bytes of |buf_| ever used, the free ranges below that by offset,
+  // and the ranges of forgotten code which may still be running.
+  size_t used_;
+  map<size_t, size_t> free_;
+  vector<pair<size_t, size_t> > retired_;
+  uintptr_t page_size_;
+  vector<unsigned char> code_;
+  vector<Stub> stubs_;
+  // How many values the code emitted so far has pushed and not popped.
+  int known_;
+  // Jumps waiting for the trace of the key to be compiled.
+  unordered_map<uint64_t, vector<JitLink> > pending_;
+};
+
+void Interpreter::jitForget(Trace* t) {
+  jit_->forget(t);
+}
+
+int Jit::jitGet(Interpreter* m, int x, int y) {
+  return m->getCell(x, y);
+}
+
+void Interpreter::jitSetIP(const Trace* t, int index) {
+  const TraceOp& op = t->ops[index];
+  running_trace_ = t;
+  ix_ = op.x;
+  iy_ = op.y;
+  vx_ = op.vx;
+  vy_ = op.vy;
+}
+
+// Returns non-zero if |t| was invalidated or the machine stopped.
+int Jit::jitPut(Interpreter* m, int x, int y, int v, int index, Trace* t) {
+  m->jitSetIP(t, index);
+  m->st_.setSp(m->st_.base() + m->jit_sp_);
+  m->putCell(x, y, v);
+  return m->halted_ || !t->alive;
+}
+
+// Called after a store into a covered cell. Returns non-zero if |t| was
+// invalidated.
+int Jit::jitCovered(Interpreter* m, int x, int y, int index, Trace* t) {
+  m->jitSetIP(t, index);
+  m->invalidateTraces(x, y);
+  return !t->alive;
+}
+
+void Jit::jitOutChar(Interpreter* m, int c) {
+  m->out_->putChar(c);
+}
+
+void Jit::jitOutInt(Interpreter* m, int v) {
+  m->out_->putInt(v);
+}
+
+// Runs the native code of |*t| and leaves the IP at the exit of the trace
+// it left from, which is stored to |*t|. Returns false like runTrace().
+// When the code returns to poll, |*t| is NULL and the IP is at the start
+// of the trace it was about to run.
+bool Interpreter::runJit(Trace** t) {
+  for (;;) {
+    jit_sp_ = st_.size();
+    Trace* exit = NULL;
+    int r = (*t)->jit(st_.base(), &jit_sp_, st_.capacity(), &exit, this);
+    st_.setSp(st_.base() + jit_sp_);
+    *t = exit;
+    if (r == JIT_GROW) {
+      st_.reserve(exit->max_push);
+      continue;
+    }
+    if (r >= 0)
+      return false;
+    if (r == JIT_POLL) {
+      static const int kDirs[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 },
+                                       { 0, -1 } };
+      jit_countdown_ = kDeadlineInterval;
+      ix_ = (int)(uint32_t)(exit->key >> 2);
+      iy_ = (int)(uint32_t)(exit->key >> 34);
+      vx_ = kDirs[exit->key & 3][0];
+      vy_ = kDirs[exit->key & 3][1];
+      *t = NULL;
+      return true;
+    }
+
+    ix_ = exit->exit_x;
+    iy_ = exit->exit_y;
+    vx_ = exit->exit_vx;
+    vy_ = exit->exit_vy;
+    if (r == JIT_TAKEN || r == JIT_NOT_TAKEN) {
+      int d = r == JIT_TAKEN ? -1 : 1;
+      if (exit->ops.back().type == T_HBRANCH) {
+        vx_ = d;
+        vy_ = 0;
+      } else {
+        vx_ = 0;
+        vy_ = d;
+      }
+    }
+    return true;
+  }
+}
+
+Interpreter::Interpreter(const Options& opts, Output* out, Input* in)
+  : opts_(opts), out_(out), in_(in), ix_(0), iy_(0), vx_(1), vy_(0),
+    steps_(0), checkpointed_at_eof_(false), seed_(opts.seed),
+    stop_requested_(false), checkpoint_requested_(false),
+    running_trace_(NULL), trace_gen_(0), jit_(NULL), jit_sp_(0),
+    jit_countdown_(kDeadlineInterval), halted_(false), status_(0) {
+  if (!opts_.dump_parts || !parseDumpParts(opts_.dump_parts, &dump_parts_))
+    dump_parts_.assign(1, D_ALL);
+}
+
+Interpreter::~Interpreter() {
+  for (auto& t : traces_)
+    delete t.second;
+  delete jit_;
+}
+
+void Interpreter::load(const Grid& prog) {
+  code_.loadFrom(prog);
+  start();
+}
+
+bool Interpreter::restore(const char* path) {
+  if (!restoreCheckpoint(path))
+    return false;
+  start();
+  return true;
+}
+
+void Interpreter::start() {
+  // The trace cache doesn't know the debug markers, and the profiler
+  // and --steps count every step.
+  if (opts_.debug || opts_.verbose || opts_.profile_path ||
+      opts_.count_steps) {
+    opts_.trace = false;
+    opts_.dispatch = false;
+  }
+  if (opts_.jit) {
+    jit_ = new Jit(this);
+    if (!opts_.trace || !jit_->init()) {
+      fprintf(stderr, "JIT is not available\n");
+      opts_.jit = false;
+    }
+  }
+  covered_.resize((size_t)code_.denseWidth() * code_.denseHeight());
+  if (opts_.dispatch) {
+    dispatch_.init(code_);
+    for (int y = dispatch_.beginRow(); y < dispatch_.endRow(); y++) {
+      for (int x = 0; x < Dispatcher::kWidth; x++)
+        coveredAt(x, y) = true;
+    }
+  }
+  if (opts_.profile_path)
+    profiler_.init(loadedLines(), code_.denseWidth());
+  if (opts_.stats_path)
+    stats_.init(opts_.stats_path, code_.denseHeight(), now());
+}
+
+int Interpreter::run() {
+  double deadline = opts_.timeout > 0 ? now() + opts_.timeout : 0;
+  int countdown = kDeadlineInterval;
+#if BEFUNGE_THREADED
+  if (!opts_.trace && !opts_.profile_path && !opts_.debug && !opts_.verbose)
+    return runThreaded(deadline);
+#endif
+  // The last trace run and |trace_gen_| at the time.
+  Trace* prev = NULL;
+  unsigned prev_gen = 0;
+  for (;;) {
+    if (checkpoint_requested_ && opts_.checkpoint_path) {
+      checkpoint_requested_ = false;
+      writeCheckpoint();
+    }
+    if (stop_requested_) {
+      if (opts_.debug) {
+        dump();
+      }
+      return 1;
+    }
+    if ((deadline || opts_.stats_path) && !--countdown) {
+      countdown = kDeadlineInterval;
+      double t = now();
+      if (deadline && t >= deadline)
+        return kTimedOut;
+      if (opts_.stats_path && stats_.due(t))
+        updateStats(t);
+    }
+
+    if (opts_.dispatch && dispatch_.jump(&ix_, &iy_, &vx_, &vy_, &st_)) {
+      step();
+      continue;
+    }
+
+    if (opts_.trace) {
+      if (prev_gen != trace_gen_)
+        prev = NULL;
+      Trace* t = findTrace(prev);
+      bool ok;
+      if (opts_.jit && (t->jit || (++t->runs == kJitThreshold &&
+                                 jit_->compile(t)))) {
+        ok = runJit(&t);
+      } else {
+        running_trace_ = t;
+        ok = runTrace(t);
+      }
+      if (halted_)
+        return status_;
+      if (!t) {
+        // Linked native code came back to poll.
+        countdown = 1;
+        prev = NULL;
+        continue;
+      }
+      if (!ok) {
+        delete t;
+        prev = NULL;
+        step();
+        continue;
+      }
+      prev = t;
+      prev_gen = trace_gen_;
+      if (t->exit_done) {
+        step();
+        continue;
+      }
+    }
+
+    int op = code_.op(ix_, iy_);
+    steps_++;
+    if (opts_.profile_path)
+      profiler_.count(ix_, iy_, op);
+    //fprintf(stderr, "op=%c\n", op);
+    switch (op) {
+    case '<':
+      vx_ = -1;
+      vy_ = 0;
+      break;
+    case '>':
+      vx_ = 1;
+      vy_ = 0;
+      break;
+    case '^':
+      vx_ = 0;
+      vy_ = -1;
+      break;
+    case 'v':
+      vx_ = 0;
+      vy_ = 1;
+      break;
+
+    case '_':
+      vy_ = 0;
+      if (pop()) {
+        vx_ = -1;
+      } else {
+        vx_ = 1;
+      }
+      break;
+    case '|':
+      vx_ = 0;
+      if (pop()) {
+        vy_ = -1;
+      } else {
+        vy_ = 1;
+      }
+      break;
+
+    case '?': 
+      switch (rand_r(&seed_) / (RAND_MAX / 4)) {
+      case 0:
+        vx_ = 1;
+        vy_ = 0;
+        break;
+      case 1:
+        vx_ = -1;
+        vy_ = 0;
+        break;
+      case 2:
+        vx_ = 0;
+        vy_ = 1;
+        break;
+      case 3:
+        vx_ = 0;
+        vy_ = -1;
+        break;
+      }
+      break;
+
+    case ' ':
+      // Crosses the run of spaces at once, unless the profile has to count
+      // each of them.
+      if (vx_ && !opts_.profile_path) {
+        int n = vx_ > 0 ? code_.spacesEast(ix_, iy_)
+                        : code_.spacesWest(ix_, iy_);
+        if (n > 1) {
+          ix_ += vx_ * (n - 1);
+          steps_ += n - 1;
+        }
+      }
+      break;
+
+    case '#':
+      step();
+      if (opts_.debug && code_.get(ix_, iy_) == 'S') {
+        dump();
+      } else if (opts_.verbose && code_.get(ix_, iy_) == 'V') {
+        dump();
+      }
+      break;
+
+    case '@': {
+      if (opts_.debug) {
+        fprintf(stderr, "program finished\n");
+        dump();
+      }
+      return 0;
+    }
+
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      push(op - '0');
+      break;
+
+    case '"':
+      step();
+      for (;;) {
+        int c = get();
+        steps_++;
+        if (opts_.profile_path)
+          profiler_.count(ix_, iy_, c);
+        if (c == '"')
+          break;
+        push(c);
+        step();
+      }
+      break;
+
+    case '&': {
+      int v;
+      if (in_->getInt(&v)) {
+        push(v);
+      } else {
+        if (in_->atEof())
+          checkpointAtEof();
+        if (opts_.bounce_on_fail_input) {
+          vx_ = -vx_;
+          vy_ = -vy_;
+        } else {
+          push(-1);
+        }
+      }
+      break;
+    }
+    case '~': {
+      int v = in_->getChar();
+      if (v == EOF)
+        checkpointAtEof();
+      if (v != EOF || !opts_.bounce_on_fail_input) {
+        push(v);
+      } else {
+        vx_ = -vx_;
+        vy_ = -vy_;
+      }
+      break;
+    }
+
+    case ',':
+      out_->putChar(pop());
+      break;
+    case '.':
+      out_->putInt(pop());
+      break;
+
+    case '+': {
+      int y = pop();
+      push(pop() + y);
+      break;
+    }
+    case '-': {
+      int y = pop();
+      push(pop() - y);
+      break;
+    }
+    case '*': {
+      int y = pop();
+      push(pop() * y);
+      break;
+    }
+    case '/': {
+      int y = pop();
+      push(pop() / y);
+      break;
+    }
+    case '%': {
+      int y = pop();
+      push(pop() % y);
+      break;
+    }
+    case '`': {
+      int y = pop();
+      push(pop() > y);
+      break;
+    }
+    case '!':
+      push(!pop());
+      break;
+
+    case ':': {
+      int v = pop();
+      push(v);
+      push(v);
+      break;
+    }
+    case '\\': {
+      int y = pop();
+      int x = pop();
+      push(y);
+      push(x);
+      break;
+    }
+    case '$':
+      pop();
+      break;
+
+    case 'g': {
+      int y = pop();
+      int x = pop();
+      if (opts_.profile_path)
+        profiler_.countGet(x, y);
+      int v = getCell(x, y);
+      //fprintf(stderr, "g x=%d y=%d v=%d\n", x, y, v);
+      push(v);
+      break;
+    }
+    case 'p': {
+      //dump();
+      int y = pop();
+      int x = pop();
+      int v = pop();
+      //fprintf(stderr, "p x=%d y=%d v=%d\n", x, y, v);
+      if (opts_.profile_path)
+        profiler_.countPut(x, y);
+      putCell(x, y, v);
+      if (halted_)
+        return status_;
+      break;
+    }
+
+#if 0
+    case 'S':
+      if (!opts_.debug)
+        goto unsupported;
+      dump();
+      break;
+#endif
+
+    default:
+      // We are very strict for unsupported operations.
+      return handleUnsupportedOp();
+
+    }
+    step();
+  }
+}
+
+#if BEFUNGE_THREADED
+
+// Handles what the switch loop looks at before each step. Returns true
+// with the status to return if the machine has to stop.
+bool Interpreter::poll(double deadline, int* status) {
+  if (checkpoint_requested_ && opts_.checkpoint_path) {
+    checkpoint_requested_ = false;
+    writeCheckpoint();
+  }
+  if (deadline || opts_.stats_path) {
+    double t = now();
+    if (deadline && t >= deadline) {
+      *status = kTimedOut;
+      return true;
+    }
+    if (opts_.stats_path && stats_.due(t))
+      updateStats(t);
+  }
+  if (stop_requested_) {
+    *status = 1;
+    return true;
+  }
+  return false;
+}
+
+// The IP is kept in locals, with the direction implied by the table the
+// handler was reached from, and the size of the current row cached in |w|
+// while going sideways. Every infinite run has to wrap around or turn, so
+// poll() is only called there.
+
+#define SYNC(D)                                 \
+  (ix_ = x, iy_ = y, vx_ = kDx[D], vy_ = kDy[D], steps_ = steps)
+
+#define POLL(D)                                 \
+  if (__builtin_expect(!--countdown, 0)) {      \
+    countdown = kDeadlineInterval;              \
+    SYNC(D);                                    \
+    int status;                                 \
+    if (poll(deadline, &status))                \
+      return status;                            \
+  }
+
+#define ADVANCE_E                               \
+  if (++x >= w) {                               \
+    x = 0;                                      \
+    POLL(DIR_E);                                \
+  }
+#define ADVANCE_W                               \
+  if (--x < 0) {                                \
+    x = w - 1;                                  \
+    POLL(DIR_W);                                \
+  }
+#define ADVANCE_S                               \
+  {                                             \
+    int py = y;                                 \
+    y = code_.nextRow(x, y);                    \
+    if (y <= py)                                \
+      POLL(DIR_S);                              \
+  }
+#define ADVANCE_N                               \
+  {                                             \
+    int py = y;                                 \
+    y = code_.prevRow(x, y);                    \
+    if (y >= py)                                \
+      POLL(DIR_N);                              \
+  }
+
+// Moves the IP to the last space of the run it is on, counting the steps
+// on the way. Runs of spaces only go sideways.
+#define SKIP_SPACES_E                           \
+  {                                             \
+    int n = code_.spacesEast(x, y);             \
+    if (n > 1) {                                \
+      x += n - 1;                               \
+      steps += n - 1;                           \
+    }                                           \
+  }
+#define SKIP_SPACES_W                           \
+  {                                             \
+    int n = code_.spacesWest(x, y);             \
+    if (n > 1) {                                \
+      x -= n - 1;                               \
+      steps += n - 1;                           \
+    }                                           \
+  }
+#define SKIP_SPACES_S
+#define SKIP_SPACES_N
+
+#define FETCH(D)                                                \
+  op = code_.op(x, y);                                          \
+  steps++;                                                      \
+  goto *tables[DIR_##D][(unsigned)op < 256 ? op : 0]
+
+#define NEXT(D)                                 \
+  ADVANCE_##D;                                  \
+  FETCH(D)
+
+#define BINARY_OP(D, name, expr)                \
+  D##_##name: {                                 \
+    int b = st_.pop();                          \
+    int a = st_.pop();                          \
+    st_.push(expr);                             \
+    NEXT(D);                                    \
+  }
+
+// The handlers of the ops which go on in direction |D|, or in |R| to
+// bounce back.
+#define DIRECTED_OPS(D, R)                                      \
+  D##_nop:                                                      \
+    SKIP_SPACES_##D;                                            \
+    NEXT(D);                                                    \
+  D##_digit:                                                    \
+    st_.push(op - '0');                                         \
+    NEXT(D);                                                    \
+  BINARY_OP(D, add, a + b)                                      \
+  BINARY_OP(D, sub, a - b)                                      \
+  BINARY_OP(D, mul, a * b)                                      \
+  BINARY_OP(D, div, a / b)                                      \
+  BINARY_OP(D, mod, a % b)                                      \
+  BINARY_OP(D, gt, a > b)                                       \
+  BINARY_OP(D, get, getCell(a, b))                            \
+  D##_not:                                                      \
+    st_.push(!st_.pop());                                       \
+    NEXT(D);                                                    \
+  D##_dup: {                                                    \
+    int v = st_.pop();                                          \
+    st_.push(v);                                                \
+    st_.push(v);                                                \
+    NEXT(D);                                                    \
+  }                                                             \
+  D##_swap: {                                                   \
+    int b = st_.pop();                                          \
+    int a = st_.pop();                                          \
+    st_.push(b);                                                \
+    st_.push(a);                                                \
+    NEXT(D);                                                    \
+  }                                                             \
+  D##_pop:                                                      \
+    st_.pop();                                                  \
+    NEXT(D);                                                    \
+  D##_put: {                                                    \
+    int b = st_.pop();                                          \
+    int a = st_.pop();                                          \
+    int v = st_.pop();                                          \
+    SYNC(DIR_##D);                                              \
+    putCell(a, b, v);                                           \
+    if (halted_)                                                \
+      return status_;                                           \
+    w = code_.rowSize(y);                                       \
+    NEXT(D);                                                    \
+  }                                                             \
+  D##_outc:                                                     \
+    out_->putChar(st_.pop());                                   \
+    NEXT(D);                                                    \
+  D##_outi:                                                     \
+    out_->putInt(st_.pop());                                    \
+    NEXT(D);                                                    \
+  D##_skip:                                                     \
+    ADVANCE_##D;                                                \
+    NEXT(D);                                                    \
+  D##_string:                                                   \
+    for (;;) {                                                  \
+      ADVANCE_##D;                                              \
+      int c = x < code_.rowSize(y) ? code_.get(x, y) : 0;       \
+      steps++;                                                  \
+      if (c == '"')                                             \
+        break;                                                  \
+      st_.push(c);                                              \
+    }                                                           \
+    NEXT(D);                                                    \
+  D##_random:                                                   \
+    switch (rand_r(&seed_) / (RAND_MAX / 4)) {                          \
+    case 0: goto go_E;                                          \
+    case 1: goto go_W;                                          \
+    case 2: goto go_S;                                          \
+    case 3: goto go_N;                                          \
+    }                                                           \
+    NEXT(D);                                                    \
+  D##_inint: {                                                  \
+    int v;                                                      \
+    if (in_->getInt(&v)) {                                      \
+      st_.push(v);                                              \
+      NEXT(D);                                                  \
+    }                                                           \
+    if (in_->atEof()) {                                         \
+      SYNC(DIR_##D);                                            \
+      checkpointAtEof();                                        \
+    }                                                           \
+    if (opts_.bounce_on_fail_input)                             \
+      goto go_##R;                                              \
+    st_.push(-1);                                               \
+    NEXT(D);                                                    \
+  }                                                             \
+  D##_inchar: {                                                 \
+    int v = in_->getChar();                                     \
+    if (v == EOF) {                                             \
+      SYNC(DIR_##D);                                            \
+      checkpointAtEof();                                        \
+      if (opts_.bounce_on_fail_input)                           \
+        goto go_##R;                                            \
+    }                                                           \
+    st_.push(v);                                                \
+    NEXT(D);                                                    \
+  }                                                             \
+  D##_end:                                                      \
+    SYNC(DIR_##D);                                              \
+    return 0;                                                   \
+  D##_unsupported:                                              \
+    SYNC(DIR_##D);                                              \
+    return handleUnsupportedOp();
+
+#define FILL_TABLE(D)                                           \
+  for (int i = 0; i < 256; i++)                                 \
+    tables[DIR_##D][i] = &&D##_unsupported;                     \
+  for (int i = '0'; i <= '9'; i++)                              \
+    tables[DIR_##D][i] = &&D##_digit;                           \
+  tables[DIR_##D][' '] = &&D##_nop;                             \
+  tables[DIR_##D]['+'] = &&D##_add;                             \
+  tables[DIR_##D]['-'] = &&D##_sub;                             \
+  tables[DIR_##D]['*'] = &&D##_mul;                             \
+  tables[DIR_##D]['/'] = &&D##_div;                             \
+  tables[DIR_##D]['%'] = &&D##_mod;                             \
+  tables[DIR_##D]['`'] = &&D##_gt;                              \
+  tables[DIR_##D]['!'] = &&D##_not;                             \
+  tables[DIR_##D][':'] = &&D##_dup;                             \
+  tables[DIR_##D]['\\'] = &&D##_swap;                           \
+  tables[DIR_##D]['$'] = &&D##_pop;                             \
+  tables[DIR_##D]['g'] = &&D##_get;                             \
+  tables[DIR_##D]['p'] = &&D##_put;                             \
+  tables[DIR_##D][','] = &&D##_outc;                            \
+  tables[DIR_##D]['.'] = &&D##_outi;                            \
+  tables[DIR_##D]['#'] = &&D##_skip;                            \
+  tables[DIR_##D]['"'] = &&D##_string;                          \
+  tables[DIR_##D]['?'] = &&D##_random;                          \
+  tables[DIR_##D]['&'] = &&D##_inint;                           \
+  tables[DIR_##D]['~'] = &&D##_inchar;                          \
+  tables[DIR_##D]['@'] = &&D##_end;                             \
+  tables[DIR_##D]['>'] = &&go_right;                            \
+  tables[DIR_##D]['<'] = &&go_left;                             \
+  tables[DIR_##D]['v'] = &&go_S;                                \
+  tables[DIR_##D]['^'] = &&go_N;                                \
+  tables[DIR_##D]['_'] = &&hbranch;                             \
+  tables[DIR_##D]['|'] = &&vbranch
+
+// Like the switch loop without the trace cache, but with a handler table
+// per direction so that each handler steps without testing the direction.
+int Interpreter::runThreaded(double deadline) {
+  enum { DIR_E, DIR_W, DIR_S, DIR_N };
+  static const int kDx[4] = { 1, -1, 0, 0 };
+  static const int kDy[4] = { 0, 0, 1, -1 };
+  void* tables[4][256];
+  FILL_TABLE(E);
+  FILL_TABLE(W);
+  FILL_TABLE(S);
+  FILL_TABLE(N);
+
+  int x = ix_;
+  int y = iy_;
+  int w = code_.rowSize(y);
+  int op;
+  int countdown = kDeadlineInterval;
+  uint64_t steps = steps_;
+  if (vx_ > 0) {
+    FETCH(E);
+  } else if (vx_ < 0) {
+    FETCH(W);
+  } else if (vy_ > 0) {
+    FETCH(S);
+  } else {
+    FETCH(N);
+  }
+
+  DIRECTED_OPS(E, W)
+  DIRECTED_OPS(W, E)
+  DIRECTED_OPS(S, N)
+  DIRECTED_OPS(N, S)
+
+  // The entries of the block dispatchers are a '>' and a '<'.
+go_right:
+  if (opts_.dispatch && dispatch_.isEntry(x, y)) {
+    int dx, dy;
+    if (dispatch_.jump(&x, &y, &dx, &dy, &st_)) {
+      w = code_.rowSize(y);
+      NEXT(E);
+    }
+  }
+  goto go_E;
+go_left:
+  if (opts_.dispatch && dispatch_.isEntry(x, y)) {
+    int dx, dy;
+    if (dispatch_.jump(&x, &y, &dx, &dy, &st_)) {
+      w = code_.rowSize(y);
+      NEXT(E);
+    }
+  }
+  goto go_W;
+hbranch:
+  if (st_.pop())
+    goto go_W;
+  goto go_E;
+vbranch:
+  if (st_.pop())
+    goto go_N;
+  goto go_S;
+
+go_E:
+  POLL(DIR_E);
+  w = code_.rowSize(y);
+  NEXT(E);
+go_W:
+  POLL(DIR_W);
+  w = code_.rowSize(y);
+  NEXT(W);
+go_S:
+  POLL(DIR_S);
+  NEXT(S);
+go_N:
+  POLL(DIR_N);
+  NEXT(N);
+}
+
+#undef SYNC
+#undef POLL
+#undef ADVANCE_E
+#undef ADVANCE_W
+#undef ADVANCE_S
+#undef ADVANCE_N
+#undef SKIP_SPACES_E
+#undef SKIP_SPACES_W
+#undef SKIP_SPACES_S
+#undef SKIP_SPACES_N
+#undef FETCH
+#undef NEXT
+#undef BINARY_OP
+#undef DIRECTED_OPS
+#undef FILL_TABLE
+
+#endif  // BEFUNGE_THREADED
+
+Program::Program() : grid_(new Grid) {
+}
+
+Program::Program(const char* src, size_t size) : grid_(new Grid) {
+  const char* end = src + size;
+  while (src != end) {
+    const char* nl = static_cast<const char*>(memchr(src, '\n', end - src));
+    if (!nl) {
+      lines_.push_back(string(src, end));
+      break;
+    }
+    lines_.push_back(string(src, nl));
+    src = nl + 1;
+  }
+  grid_->load(lines_);
+  DispatchMap map;
+  Dispatcher::find(*grid_, &map);
+  grid_->setDispatchMap(map);
+}
+
+Program::~Program() {
+  delete grid_;
+}
+
+Program* Program::read(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  char magic[8];
+  if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      !memcmp(magic, kCompiledMagic, sizeof(magic))) {
+    Program* prog = new Program();
+    const char* error = prog->grid_->loadCompiled(fd);
+    if (!error)
+      return prog;
+    fprintf(stderr, "%s: %s\n", path, error);
+    delete prog;
+    close(fd);
+    return NULL;
+  }
+  string src;
+  char buf[1 << 16];
+  for (;;) {
+    ssize_t n = ::read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    src.append(buf, n);
+  }
+  close(fd);
+  return new Program(src.data(), src.size());
+}
+
+bool Program::writeCompiled(const char* path) const {
+  return grid_->writeCompiled(path);
+}
+
+Machine::Machine(const Options& opts, Output* out, Input* in)
+  : interp_(new Interpreter(opts, out, in)) {
+}
+
+Machine::~Machine() {
+  delete interp_;
+}
+
+void Machine::load(const Program& prog) {
+  interp_->load(*prog.grid_);
+}
+
+bool Machine::restore(const char* path) {
+  return interp_->restore(path);
+}
+
+int Machine::run() {
+  return interp_->run();
+}
+
+void Machine::requestStop() {
+  interp_->requestStop();
+}
+
+void Machine::requestCheckpoint() {
+  interp_->requestCheckpoint();
+}
+
+void Machine::dump() {
+  interp_->dump();
+}
+
+void Machine::writeProfile() {
+  interp_->writeProfile();
+}
+
+void Machine::writeStats() {
+  interp_->writeStats();
+}
+
+uint64_t Machine::steps() const {
+  return interp_->steps();
+}
+
+}  // namespace Befunge
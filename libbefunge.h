@@ -0,0 +1,153 @@
+// The interpreter of befunge as a library.
+//
+// A Program is read once and can be shared by any number of machines,
+// which keep all their state to themselves, so a process can run many of
+// them at once on threads of its own. Standard I/O goes through Output
+// and Input, which write to and read from file descriptors, callbacks, or
+// memory. befunge.cc is the command line front end of this.
+//
+//   Befunge::Program prog(src.data(), src.size());
+//   std::string result;
+//   Output out([&](const char* p, size_t n) { result.append(p, n); });
+//   Input in(query.data(), query.size());
+//   Befunge::Machine m(Befunge::Options(), &out, &in);
+//   m.load(prog);
+//   int status = m.run();
+//   out.flush();
+
+#ifndef LIBBEFUNGE_H_
+#define LIBBEFUNGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "befunge_io.h"
+
+namespace Befunge {
+
+// How a Machine runs. The defaults are what befunge does without flags.
+struct Options {
+  Options()
+    : debug(false), verbose(false), bounce_on_fail_input(false),
+      trace(true), jit(false), dispatch(true), count_steps(false),
+      profile_path(NULL), checkpoint_path(NULL), stats_path(NULL),
+      dump_parts(NULL), core_path(NULL), timeout(0), seed(1) {
+  }
+
+  bool debug;
+  bool verbose;
+  bool bounce_on_fail_input;
+  bool trace;
+  bool jit;
+  bool dispatch;
+  bool count_steps;
+  const char* profile_path;
+  const char* checkpoint_path;
+  // Where to keep the live counters of befunge_stats.h.
+  const char* stats_path;
+  // What dumps show, as a comma separated list of parts, or NULL for
+  // "all", which is every cell of the space and the stack:
+  //   ip      the cells around the IP
+  //   values  the stack
+  //   reg     the first two rows as numbers, the registers of bc2bef
+  //   code    the rows of the loaded program
+  //   local, phi, low, stack, global, heap, other
+  //           the nonzero cells of a memory region of bc2bef by address,
+  //           as befunge_profile.h splits it
+  // Dumps happen at "#S" with |debug|, "#V" with |verbose|, and when the
+  // program fails.
+  const char* dump_parts;
+  // If set, dumps write a snapshot there instead, which befdump shows.
+  const char* core_path;
+  // In seconds, or 0 to run until the program ends.
+  double timeout;
+  // Where the directions '?' picks start from.
+  unsigned seed;
+};
+
+class Grid;
+class Interpreter;
+
+// Whether |parts| is a valid Options::dump_parts.
+bool validDumpParts(const char* parts);
+
+// A program as machines load it. It never changes once made, and
+// everything loading it derives is worked out here once for all of them.
+class Program {
+public:
+  // |size| bytes at |src| as a .bef file has them.
+  Program(const char* src, size_t size);
+  ~Program();
+
+  // Reads a .bef file, or a .befc file writeCompiled() wrote, which is
+  // mapped as it is. Returns NULL if |path| can't be read or is a .befc
+  // file this build can't use, which it says on stderr.
+  static Program* read(const char* path);
+
+  // Writes the program as loaded to |path|, for read() to start quickly.
+  bool writeCompiled(const char* path) const;
+
+  // The rows of the source. Empty for a program read from a .befc file.
+  const std::vector<std::string>& lines() const { return lines_; }
+
+private:
+  friend class Machine;
+
+  Program();
+  Program(const Program&);
+  void operator=(const Program&);
+
+  std::vector<std::string> lines_;
+  Grid* grid_;
+};
+
+// One run of a program. |out| and |in| must outlive the machine, and
+// |out| has to be flushed once run() returns.
+class Machine {
+public:
+  // What run() returns when the timeout passed.
+  static const int kTimedOut = -1;
+
+  Machine(const Options& opts, Output* out, Input* in);
+  ~Machine();
+
+  // |prog| has to outlive the machine.
+  void load(const Program& prog);
+  // Loads a snapshot written by --checkpoint or --core instead of a
+  // program.
+  bool restore(const char* path);
+
+  // Runs the program until it ends, and returns its exit status.
+  int run();
+
+  // Make run() return 1, and write a checkpoint if |checkpoint_path| is
+  // set, at the next point it looks. Both are safe to call from signal
+  // handlers and other threads.
+  void requestStop();
+  void requestCheckpoint();
+
+  // Prints the state to stderr as |dump_parts| asks, or writes it to
+  // |core_path|.
+  void dump();
+  // Writes what --profile asked for.
+  void writeProfile();
+  // Updates the file of |stats_path| with the final counts.
+  void writeStats();
+
+  // The cells run so far, which counts every step only with
+  // |count_steps|.
+  uint64_t steps() const;
+
+private:
+  Machine(const Machine&);
+  void operator=(const Machine&);
+
+  Interpreter* interp_;
+};
+
+}  // namespace Befunge
+
+#endif  // LIBBEFUNGE_H_
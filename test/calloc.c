@@ -0,0 +1,49 @@
+#include "libef.h"
+
+__attribute__((noinline)) static void fill(int* p, int n, int v) {
+  int i;
+  for (i = 0; i < n; i++)
+    p[i] = v + i;
+}
+
+__attribute__((noinline)) static void check(int* p, int n) {
+  int i;
+  int sum = 0;
+  for (i = 0; i < n; i++)
+    sum += p[i];
+  print_int(n);
+  putchar(sum ? 'x' : 'o');
+  putchar(' ');
+}
+
+int main() {
+  int round;
+  for (round = 0; round < 3; round++) {
+    int* a = calloc(1, 4);
+    int* b = calloc(3, 4);
+    int* c = calloc(3, 4);
+    int* d = calloc(7, 4);
+    int* e = calloc(15, 4);
+    int* f = calloc(20, 4);
+    check(a, 1);
+    check(b, 3);
+    check(c, 3);
+    check(d, 7);
+    check(e, 15);
+    check(f, 20);
+    putchar('\n');
+    fill(a, 1, 'a');
+    fill(b, 3, 'b');
+    fill(c, 3, 'c');
+    fill(d, 7, 'd');
+    fill(e, 15, 'e');
+    fill(f, 20, 'f');
+    free(c);
+    free(a);
+    free(e);
+    free(b);
+    free(f);
+    free(d);
+  }
+  return 0;
+}
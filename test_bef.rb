@@ -8,6 +8,13 @@ def getResult(cmd, input)
   o
 end
 
+# With -l, runs the programs bc2bef -l generated instead.
+suffix = '.bef'
+if ARGV[0] == '-l'
+  ARGV.shift
+  suffix = '.l.bef'
+end
+
 num_tests = 0
 fails = []
 
@@ -18,7 +25,7 @@ ARGV.each do |test|
   tests.each do |test_case|
     input = test_case == test_path ? '' : File.read(test_case)
     expected = getResult([test_path], input)
-    actual = getResult(['./befunge', "#{test_path}.bef"], input)
+    actual = getResult(['./befunge', "#{test_path}#{suffix}"], input)
     #actual = getResult(['./ccbi', "#{test_path}.bef"], input)
     #actual = getResult(['./cfunge', "#{test_path}.bef"], input)
     if expected == actual
@@ -0,0 +1,91 @@
+#!/usr/bin/env ruby
+#
+# Compiles Befunge programs with bef2c and checks the compiled ones
+# write the same bytes as ./befunge does for the same input.
+#
+#   $ ./test_bef2c.rb [prog.bef ...]
+#
+# Without arguments, this runs test/*.bef with their test/*.in, and
+# beflisp.bef with test.l. bc2bef keeps locals in memory and stores to
+# them through pointers, which -s can't prove never change what runs, so
+# this also checks that -s refuses the programs in REFUSED.
+
+require 'tmpdir'
+
+def getResult(cmd, input)
+  pipe = IO.popen(cmd, 'r+')
+  pipe.write(input)
+  pipe.close_write
+  o = pipe.read
+  pipe.close
+  o
+end
+
+def inputsOf(bef)
+  case bef
+  when 'beflisp.bef'
+    ['test.l']
+  when 'beflisp2d.bef'
+    ['fizzbuzz.l2d']
+  else
+    # bc2bef -l output, test/foo.l.bef, takes the inputs of test/foo.bef.
+    ins = Dir.glob(bef.sub(/(\.l)?\.bef$/, '*.in')).sort
+    ins.empty? ? [nil] : ins
+  end
+end
+
+REFUSED = %w(
+  test/cmp_eq.bef test/cmp_ge.bef test/cmp_gt.bef test/cmp_le.bef
+  test/cmp_lt.bef test/cmp_ne.bef test/nullptr.bef test/puts.bef
+)
+
+befs = ARGV.empty? ? Dir.glob('test/*.bef').sort + ['beflisp.bef'] : ARGV
+
+num_tests = 0
+fails = []
+
+Dir.mktmpdir do |dir|
+  befs.each do |bef|
+    c = File.join(dir, File.basename(bef, '.bef') + '.c')
+    exe = c.sub(/\.c$/, '')
+    if REFUSED.include?(bef)
+      if system('./bef2c', '-s', '-o', c, bef, err: File::NULL)
+        puts "#{bef}: FAIL -s didn't refuse it"
+        fails << bef
+      else
+        puts "#{bef}: OK (-s refuses it)"
+      end
+      num_tests += 1
+    end
+    if !system('./bef2c', '-o', c, bef) ||
+        !system('gcc', '-O2', c, '-o', exe)
+      puts "#{bef}: FAIL to compile"
+      fails << bef
+      num_tests += 1
+      next
+    end
+
+    inputsOf(bef).each do |input_path|
+      test_case = input_path ? "#{bef} < #{input_path}" : bef
+      input = input_path ? File.read(input_path) : ''
+      expected = getResult(['./befunge', bef], input)
+      actual = getResult([exe], input)
+      if expected == actual
+        puts "#{test_case}: OK (#{expected.sub(/\n.*/ms, '...')})"
+      else
+        puts "#{test_case}: FAIL expected=#{expected} actual=#{actual}"
+        fails << test_case
+      end
+      num_tests += 1
+    end
+  end
+end
+
+if fails.empty?
+  puts 'PASS'
+else
+  puts "Failed tests:"
+  puts fails.map{|f|f.inspect}
+  puts "#{fails.size} / #{num_tests} FAIL"
+  exit 1
+end